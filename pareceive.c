@@ -1,13 +1,33 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sched.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/syscall.h>
+#include <poll.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 #include <pulse/pulseaudio.h>
+#include <alsa/asoundlib.h>
 
-#include "libavformat/avio.h"
-#include "libavformat/avformat.h"
 #include "libswresample/swresample.h"
+#include "libavutil/opt.h"
 #include "libavcodec/avcodec.h"
 
 static char *indevice = NULL;
@@ -17,17 +37,93 @@ static pa_context *context = NULL;
 static pa_stream *instream = NULL;
 static pa_stream *outstream = NULL;
 static pa_mainloop_api *mainloop_api = NULL;
+static pa_threaded_mainloop *mainloop = NULL;
+
+/* PulseAudio callbacks run on the mainloop thread, decoding runs on its own
+ * thread. Both hold the mainloop lock while touching PulseAudio objects */
+static pthread_t decode_thread;
+static int quitting = 0, quit_ret = 0;
 
 #define SILENCE_CHECK_SIZE 12288
 
-static void *inbuffer = NULL;
-static size_t inbuffer_length = 0, inbuffer_index = 0;
+/* Fixed-capacity ring buffer. The storage is mapped twice back to back, so
+ * both the readable and the writable region are always contiguous in memory
+ * and never need to be compacted. The size is a power of two.
+ * One thread may write while another one reads without locking, growing and
+ * clearing it needs both of them stopped. */
+struct ringbuffer
+{
+	uint8_t *data;
+	size_t size;
+	size_t read, write;
+};
+
+static struct ringbuffer inbuffer = {0}, outbuffer = {0};
+
+/* Data read from stdin waiting for the decode thread */
+static struct ringbuffer stdinbuffer = {0};
+#define STDIN_BUFFER_SIZE (1024*1024)
+#define STDIN_PIPE_SIZE (1024*1024)	/* the default pipe-max-size */
+static int stdin_paused = 0, stdin_eof = 0;
 
-static void *outbuffer = NULL;
-static size_t outbuffer_length = 0, outbuffer_index = 0;
+/* Set by the decode thread once all input has been consumed */
+static int input_done = 0;
 
 static pa_io_event* stdio_event = NULL;
 
+/* Direct ALSA capture, used for an indevice of alsa:NAME. The decode thread
+ * reads straight from the mmap'd hardware buffer */
+#define CAPTURE_PERIOD 1024		/* frames */
+#define CAPTURE_BUFFER 32768		/* frames */
+static snd_pcm_t *capture = NULL;
+static struct pollfd *capture_fds = NULL;
+static pa_io_event **capture_events = NULL;
+static int capture_nfds = 0;
+static int capture_pending = 0;		/* woken up, waiting for the decode thread */
+static size_t capture_fragsize = SILENCE_CHECK_SIZE;	/* bytes decoded at once at most */
+static snd_pcm_uframes_t capture_period = 0, capture_buffer = 0;
+
+/* Replaying a capture, used for an indevice of file:PATH. The decode thread
+ * parses straight from the mapped file, paced like a live source or as fast
+ * as it can. It reads stdin_fragsize at a time and ends like stdin does */
+static const uint8_t *replay_data = NULL;
+static size_t replay_size = 0, replay_pos = 0;
+static double replay_seek = 0;		/* seconds, only for the first pass */
+static unsigned long replay_loops = 1;	/* passes over the file, 0 is forever */
+static int replay_fast = 0;
+static uint64_t replay_start = 0;	/* nsec, CLOCK_MONOTONIC */
+static uint64_t replay_fed = 0;		/* bytes handed to decode_data() since replay_start */
+static pa_time_event *replay_event = NULL;
+
+#define ANALYZER_MAX_CHANNELS 8
+
+/* Result of analyze_signal() for one fragment of input */
+struct signal_analysis
+{
+	int zero;		/* all samples are zero */
+	int dc;			/* every channel is constant, i.e. carries no audio */
+	int silent;		/* either of the above */
+	unsigned channels;	/* channels metered, 0 if the format is not supported */
+	size_t frames;
+	int16_t peak[ANALYZER_MAX_CHANNELS];
+	int64_t sum[ANALYZER_MAX_CHANNELS];
+	uint64_t sumsq[ANALYZER_MAX_CHANNELS];
+};
+
+static struct signal_analysis signal_level = {0};
+
+/* IEC61937 lock-on progress over the data accumulated in inbuffer, so that
+ * every byte is searched only once however many reads it takes */
+struct iec61937_tracker
+{
+	int syncs;		/* sync words found so far, 0 to 2 */
+	size_t scanned;		/* where the next search starts */
+	size_t first;		/* offset of the first sync word */
+	size_t period;		/* distance to the second one */
+};
+
+static struct iec61937_tracker tracker = {0};
+
 uint32_t tlength = 0;
 
 static int verbose = 1;
@@ -40,30 +136,470 @@ static pa_sample_spec in_sample_spec =
 };
 pa_sample_spec out_sample_spec;
 
-const char* input_device_name = "stdin";
 #define PA_MAX_BUF (1024*1024*96)
 #define MAX_STDIN_READ 16384
 size_t stdin_fragsize = 0;
 
-static pa_stream_flags_t inflags = PA_STREAM_FIX_RATE | PA_STREAM_FIX_FORMAT | PA_STREAM_NO_REMIX_CHANNELS | PA_STREAM_NO_REMAP_CHANNELS | PA_STREAM_VARIABLE_RATE | PA_STREAM_DONT_MOVE | PA_STREAM_START_UNMUTED | PA_STREAM_PASSTHROUGH | PA_STREAM_ADJUST_LATENCY;
-static pa_stream_flags_t outflags = PA_STREAM_ADJUST_LATENCY;
+static pa_stream_flags_t inflags = PA_STREAM_FIX_RATE | PA_STREAM_FIX_FORMAT | PA_STREAM_NO_REMIX_CHANNELS | PA_STREAM_NO_REMAP_CHANNELS | PA_STREAM_VARIABLE_RATE | PA_STREAM_DONT_MOVE | PA_STREAM_START_UNMUTED | PA_STREAM_PASSTHROUGH | PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
+static pa_stream_flags_t outflags = PA_STREAM_ADJUST_LATENCY | PA_STREAM_VARIABLE_RATE | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE;
 
 enum state {NOSIGNAL, PCM, IEC61937} state=NOSIGNAL;
 
-static AVFormatContext *avformatcontext = NULL;
 static AVCodecContext *avcodeccontext = NULL;
 static AVFrame *avframe;
 static AVPacket *pkt;
+static size_t block_size = 0;
+
+/* Decoder threading from --threads and --thread-type */
+#define DECODER_FRAME_DELAY 2		/* bursts frame threads may hold back without --latency */
+static int decoder_threads = 1;		/* 0 is one per CPU */
+static int decoder_thread_type = FF_THREAD_SLICE;
 
 static SwrContext *swrcontext = NULL;
 enum AVSampleFormat swroutformat = AV_SAMPLE_FMT_NONE;
 size_t out_bytes_per_sample = 4;
 
-/* A shortcut for terminating the application */
+/* Decoded audio format swrcontext is set up for */
+struct decoded_format
+{
+	int sample_rate;
+	AVChannelLayout ch_layout;
+	enum AVSampleFormat sample_fmt;
+};
+
+static struct decoded_format decoded_format = {0};
+
+/* --pin: every source is converted to one output format and the stream stays
+ * open across state changes, only the converters are set up again */
+#define PINNED_TLENGTH 64000		/* usec, two AC-3 bursts */
+static int pinned = 0;
+static AVChannelLayout pinned_layout = {0};
+static pa_sample_spec pinned_spec;
+static SwrContext *pcm_swrcontext = NULL;	/* PCM input to the pinned format */
+static pa_sample_spec pcm_converted_spec;	/* input format pcm_swrcontext is set up for */
+static pa_channel_map pcm_converted_map;
+static int iec61937_announced = 0;
+static size_t iec61937_since_burst = 0;		/* bytes taken since the start of the last audio burst */
+static size_t iec61937_burst_distance = 0;	/* from the start of the audio burst before the one in pkt */
+
+/* --passthrough: bursts the sink can decode are sent to it untouched */
+static int passthrough = 0;
+static enum AVCodecID passthrough_codec = AV_CODEC_ID_NONE;	/* of the open passthrough stream */
+static pa_encoding_t passthrough_encoding = PA_ENCODING_INVALID;
+static uint32_t passthrough_rejected = 0;	/* a bit per encoding the sink turned down */
+
+/* Closed-loop latency control, see latency_control_callback() */
+#define LATENCY_CONTROL_INTERVAL 1000000	/* usec */
+#define LATENCY_CONTROL_SETTLE 3		/* intervals before the target is taken */
+#define LATENCY_CONTROL_MAX_PPM 1000.0
+static pa_time_event *latency_event = NULL;
+static pa_usec_t target_latency = 0;	/* from --latency, 0 holds the latency found after settling */
+static pa_usec_t locked_latency = 0;	/* target in use for the current output stream */
+static double measured_latency = 0;	/* filtered output stream plus outbuffer latency, usec */
+static unsigned latency_samples = 0;
+static double drift_ppm = 0;		/* estimated source clock speed relative to the sink */
+static double correction_ppm = 0;	/* output rate correction currently requested */
+static uint32_t corrected_rate = 0;	/* PCM: sample rate the output stream was updated to */
+#define COMPENSATION_UNSET 0
+static int32_t compensation_ppm = 0;	/* IEC61937: requested swr compensation, read by the decode thread */
+static uint32_t compensation_tick = COMPENSATION_UNSET;	/* bumped with every request */
+static uint32_t compensation_applied = COMPENSATION_UNSET;	/* tick of the request in effect */
+static size_t dropped_bytes = 0;	/* outbuffer data thrown away because the controller fell behind */
+
+/* --realtime: the threads that move audio get SCHED_FIFO, memory is locked
+ * and faulted in at setup rather than on the first write */
+#define REALTIME_PRIORITY 20		/* what RLIMIT_RTPRIO usually allows */
+#define REALTIME_STACK (256*1024)
+#define JITTER_PROBES 200
+#define JITTER_PERIOD 1000000		/* nsec */
+static int realtime = 0;
+static double jitter_avg = 0, jitter_max = 0;	/* usec, decode thread wakeups measured at startup */
+static pa_usec_t timer_late_max = 0;		/* usec, latency control timer */
+
+/* --bench runs the pipeline without PulseAudio, into the null backend */
+static int offline = 0;
+
+/* Where decoded audio goes. PulseAudio asks for data through its write
+ * callback, the other backends take what is written and pace themselves */
+struct output_backend
+{
+	/* Starts a stream, returns a negative value on failure */
+	int (*open)(const pa_sample_spec *spec, const pa_channel_map *map);
+	/* Plays out what has been written, then the stream goes away */
+	void (*close)(void);
+	int (*is_open)(void);
+	/* Bytes that can be written now, 0 until the stream is ready */
+	size_t (*writable_size)(void);
+	/* Gets a buffer owned by the backend, *l may come back smaller */
+	int (*begin_write)(void **buf, size_t *l);
+	void (*cancel_write)(void);
+	/* Takes a buffer from begin_write() or any other data */
+	int (*write)(const void *data, size_t l);
+	/* The input has ended: plays everything out and calls output_drained() */
+	void (*drain)(void);
+	/* Releases what is kept across streams, may be NULL */
+	void (*free)(void);
+	/* Starts a stream of IEC61937 bursts the sink decodes itself. May be NULL.
+	 * If the sink turns the encoding down later, is_open() goes back to 0 */
+	int (*open_passthrough)(pa_encoding_t encoding, const pa_sample_spec *spec);
+	/* Audio queued in the backend for the latency controller, returns a
+	 * negative value while it is not playing. May be NULL, then no drift is
+	 * corrected */
+	int (*latency)(pa_usec_t *usec);
+	/* Plays PCM at a corrected sample rate. May be NULL, then PCM goes
+	 * through a converter the correction is applied to */
+	int (*update_rate)(uint32_t rate);
+};
+
+static const struct output_backend *output = NULL;
+static int output_direct_write = 0;	/* the decode thread fills a buffer from begin_write() without the lock */
+
+/* Counters served on the metrics socket */
+static char *metrics_path = NULL;
+static int metrics_fd = -1;
+static pa_io_event *metrics_event = NULL;
+static unsigned long underruns = 0, overruns = 0;
+static unsigned long state_transitions = 0, decoder_opens = 0;
+static unsigned long missed_frames_count = 0;
+static int total_missed_frames = 0;	/* consecutive, resets when a block decodes */
+static unsigned long concealed_frames = 0;	/* lost bursts played as silence */
+#define ERROR_RATE_WINDOW 32		/* bursts */
+static double error_rate = 0;		/* moving share of the bursts that did not decode */
+static double max_error_rate = 0.5;	/* sustained above it the decoder is torn down */
+
+#define DECODER_CACHE_SIZE 4
+
+/* Decoder and converter kept warm across a signal drop-out */
+struct decoder_cache_entry
+{
+	AVCodecContext *codec;
+	SwrContext *swr;
+	struct decoded_format format;
+	unsigned long last_used;
+};
+
+static struct decoder_cache_entry decoder_cache[DECODER_CACHE_SIZE] = {0};
+static unsigned long decoder_cache_hits = 0, decoder_cache_misses = 0;
+static int decoder_cache_pending = 0;	/* resumed from the cache, the first frame tells if it was a hit */
+
+/* Number of bytes available for reading */
+static inline size_t ringbuffer_length(const struct ringbuffer *rb)
+{
+	return __atomic_load_n(&rb->write, __ATOMIC_ACQUIRE) - __atomic_load_n(&rb->read, __ATOMIC_ACQUIRE);
+}
+
+/* Number of bytes that can be written without growing the buffer */
+static inline size_t ringbuffer_space(const struct ringbuffer *rb)
+{
+	return rb->size - ringbuffer_length(rb);
+}
+
+/* Start of the readable span, ringbuffer_length() bytes long */
+static inline uint8_t *ringbuffer_read_ptr(const struct ringbuffer *rb)
+{
+	return rb->data + (rb->read & (rb->size - 1));
+}
+
+/* Start of the writable span, ringbuffer_space() bytes long */
+static inline uint8_t *ringbuffer_write_ptr(const struct ringbuffer *rb)
+{
+	return rb->data + (rb->write & (rb->size - 1));
+}
+
+/* Mark l bytes of the writable span as filled */
+static inline void ringbuffer_commit(struct ringbuffer *rb, size_t l)
+{
+	assert(l <= ringbuffer_space(rb));
+	__atomic_store_n(&rb->write, rb->write + l, __ATOMIC_RELEASE);
+}
+
+/* Discard l bytes from the readable span */
+static inline void ringbuffer_drop(struct ringbuffer *rb, size_t l)
+{
+	assert(l <= ringbuffer_length(rb));
+	__atomic_store_n(&rb->read, rb->read + l, __ATOMIC_RELEASE);
+}
+
+static inline void ringbuffer_clear(struct ringbuffer *rb)
+{
+	rb->read = rb->write = 0;
+}
+
+static void ringbuffer_free(struct ringbuffer *rb)
+{
+	if (rb->data)
+		munmap(rb->data, rb->size * 2);
+	rb->data = NULL;
+	rb->size = rb->read = rb->write = 0;
+}
+
+/* Makes sure at least l bytes can be written. Only reallocates (and copies the
+ * pending data) if the current capacity is not enough, which should not happen
+ * once the stream parameters are known */
+static void ringbuffer_reserve(struct ringbuffer *rb, size_t l)
+{
+	struct ringbuffer new = {0};
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+	int fd;
+
+	if (rb->data && ringbuffer_space(rb) >= l)
+		return;
+
+	for (new.size = pagesize; new.size < ringbuffer_length(rb) + l; new.size *= 2);
+
+	if ((fd = memfd_create("pareceive", MFD_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "memfd_create() failed: %s\n", strerror(errno));
+		abort();
+	}
+
+	if (ftruncate(fd, new.size) < 0)
+	{
+		fprintf(stderr, "ftruncate() failed: %s\n", strerror(errno));
+		abort();
+	}
+
+	/* In real time mode both halves are faulted in here, not while streaming */
+	int populate = realtime ? MAP_POPULATE : 0;
+
+	if ((new.data = mmap(NULL, new.size * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED
+		|| mmap(new.data, new.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, 0) == MAP_FAILED
+		|| mmap(new.data + new.size, new.size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED | populate, fd, 0) == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+		abort();
+	}
+
+	close(fd);
+
+	if (rb->data)
+	{
+#ifdef DEBUG_LATENCY
+		fprintf(stderr, "Growing ring buffer from %zu to %zu bytes\n", rb->size, new.size);
+#endif
+		memcpy(new.data, ringbuffer_read_ptr(rb), ringbuffer_length(rb));
+		new.write = ringbuffer_length(rb);
+		ringbuffer_free(rb);
+	}
+
+	*rb = new;
+}
+
+/* Appends l bytes to the buffer */
+static void ringbuffer_write(struct ringbuffer *rb, const void *data, size_t l)
+{
+	ringbuffer_reserve(rb, l);
+	memcpy(ringbuffer_write_ptr(rb), data, l);
+	ringbuffer_commit(rb, l);
+}
+
+/* Working memory of a stream. Set up when the stream is configured and handed
+ * out by bumping a pointer, nothing in it is freed on its own. Only the decode
+ * thread uses it, so it needs no lock */
+struct arena
+{
+	uint8_t *data;
+	size_t size, used;
+};
+
+static struct arena stream_arena = {0};
+
+/* Starts the arena over with room for at least l bytes. Whatever was carved
+ * out of it before must not be in use anymore */
+static void arena_reset(struct arena *a, size_t l)
+{
+	size_t pagesize = sysconf(_SC_PAGESIZE);
+
+	a->used = 0;
+
+	if (a->data && a->size >= l)
+		return;
+
+	if (a->data)
+		munmap(a->data, a->size);
+
+	a->size = (l + pagesize - 1) / pagesize * pagesize;
+
+	/* In real time mode it is faulted in here, not while streaming */
+	if ((a->data = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | (realtime ? MAP_POPULATE : 0), -1, 0)) == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+		abort();
+	}
+}
+
+/* Returns l bytes aligned for SIMD, or NULL if the arena is used up */
+static void *arena_alloc(struct arena *a, size_t l)
+{
+	size_t start = (a->used + 63) & ~(size_t)63;
+
+	if (!a->data || start + l > a->size)
+		return NULL;
+
+	a->used = start + l;
+	return a->data + start;
+}
+
+static void arena_free(struct arena *a)
+{
+	if (a->data)
+		munmap(a->data, a->size);
+	memset(a, 0, sizeof(*a));
+}
+
+/* Hooks of the allocation watch that the tests preload, see tests/allocwatch.c.
+ * They are weak references, NULL in a normal run */
+extern void allocwatch_thread(void) __attribute__((weak));
+extern void allocwatch_steady(int steady) __attribute__((weak));
+extern void allocwatch_decoder(int inside) __attribute__((weak));
+extern unsigned long allocwatch_allocations(void) __attribute__((weak));
+extern unsigned long allocwatch_steady_allocations(void) __attribute__((weak));
+extern unsigned long allocwatch_decoder_allocations(void) __attribute__((weak));
+
+/* Once the stream is playing the decode thread must not allocate */
+static void alloc_steady(int steady)
+{
+	if (allocwatch_steady)
+		allocwatch_steady(steady);
+}
+
+/* Allocations inside the decoder are FFmpeg's own and are only counted */
+static inline void alloc_decoder(int inside)
+{
+	if (allocwatch_decoder)
+		allocwatch_decoder(inside);
+}
+
+/* Hot path tracing. Every thread records into its own ring, so recording
+ * takes no lock; a disabled tracer costs one predictable branch per stage */
+#define TRACE_RING_SIZE 16384
+#define TRACE_MAX_THREADS 8
+
+struct trace_event
+{
+	const char *name;
+	uint64_t start, end;	/* nsec, CLOCK_MONOTONIC */
+};
+
+struct trace_ring
+{
+	long tid;
+	char thread_name[16];
+	size_t write;		/* free running, events before write-TRACE_RING_SIZE are overwritten */
+	struct trace_event events[TRACE_RING_SIZE];
+};
+
+static char *trace_path = NULL;
+static int tracing = 0;
+static uint64_t trace_epoch = 0;
+static struct trace_ring *trace_rings[TRACE_MAX_THREADS];
+static int trace_ring_count = 0;
+static __thread struct trace_ring *trace_ring = NULL;
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static inline uint64_t trace_begin(void)
+{
+	return __builtin_expect(tracing, 0) ? trace_now() : 0;
+}
+
+static void trace_record(const char *name, uint64_t start)
+{
+	if (!trace_ring)
+	{
+		int i = __atomic_fetch_add(&trace_ring_count, 1, __ATOMIC_RELAXED);
+		if (i >= TRACE_MAX_THREADS || !(trace_ring = calloc(1, sizeof(*trace_ring))))
+			return;
+		trace_ring->tid = syscall(SYS_gettid);
+		pthread_getname_np(pthread_self(), trace_ring->thread_name, sizeof(trace_ring->thread_name));
+		__atomic_store_n(&trace_rings[i], trace_ring, __ATOMIC_RELEASE);
+	}
+
+	struct trace_event *e = &trace_ring->events[trace_ring->write % TRACE_RING_SIZE];
+	e->name = name;
+	e->start = start;
+	e->end = trace_now();
+	__atomic_store_n(&trace_ring->write, trace_ring->write + 1, __ATOMIC_RELEASE);
+}
+
+static inline void trace_end(const char *name, uint64_t start)
+{
+	if (__builtin_expect(start != 0, 0))
+		trace_record(name, start);
+}
+
+/* Writes the recorded events as Chrome trace JSON, which Perfetto and
+ * chrome://tracing load. The oldest events may be torn if a thread is
+ * recording while the ring wraps around, they are dropped then */
+static void trace_dump(const char *path)
+{
+	FILE *f;
+	int i, first = 1;
+
+	if (!(f = fopen(path, "w")))
+	{
+		fprintf(stderr, "Cannot write trace to %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	fprintf(f, "{\"traceEvents\":[");
+
+	for (i = 0; i < TRACE_MAX_THREADS; i++)
+	{
+		struct trace_ring *r = __atomic_load_n(&trace_rings[i], __ATOMIC_ACQUIRE);
+		if (!r)
+			continue;
+
+		size_t end = __atomic_load_n(&r->write, __ATOMIC_ACQUIRE);
+		size_t n = end < TRACE_RING_SIZE ? end : TRACE_RING_SIZE - 1;
+
+		fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"%s\"}}", first ? "" : ",", getpid(), r->tid, r->thread_name);
+		first = 0;
+
+		for (size_t j = end - n; j != end; j++)
+		{
+			const struct trace_event *e = &r->events[j % TRACE_RING_SIZE];
+			if (e->start < trace_epoch || e->end < e->start)
+				continue;
+			fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f}",
+					e->name, getpid(), r->tid, (e->start - trace_epoch) / 1e3, (e->end - e->start) / 1e3);
+		}
+	}
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	if (verbose)
+		fprintf(stderr, "Trace written to %s\n", path);
+}
+
+/* The decode path takes the mainloop lock only when there is a mainloop */
+static inline void decoder_lock(void)
+{
+	if (mainloop)
+		pa_threaded_mainloop_lock(mainloop);
+}
+
+static inline void decoder_unlock(void)
+{
+	if (mainloop)
+		pa_threaded_mainloop_unlock(mainloop);
+}
+
+/* A shortcut for terminating the application. Must be called with the mainloop lock held */
 static void quit(int ret)
 {
-	assert(mainloop_api);
-	mainloop_api->quit(mainloop_api, ret);
+	assert(mainloop);
+	if (!quitting)
+		quit_ret = ret;
+	quitting = 1;
+	pa_threaded_mainloop_signal(mainloop, 0);
 }
 
 /* Connection draining complete */
@@ -87,6 +623,15 @@ static void start_context_drain(pa_context *c)
 	}
 }
 
+/* Everything has been played after the input ended */
+static void output_drained(void)
+{
+	if (context)
+		start_context_drain(context);
+	else
+		quit(0);
+}
+
 /* Stream draining complete */
 static void stream_drain_complete(pa_stream *s, int success, void *userdata)
 {
@@ -106,8 +651,8 @@ static void stream_drain_complete(pa_stream *s, int success, void *userdata)
 	{
 		outstream = NULL;
 
-		if (!instream && !stdio_event)
-			start_context_drain(context);
+		if (input_done)
+			output_drained();
 	}
 }
 
@@ -122,8 +667,8 @@ static void start_drain(pa_stream *s)
 	if(!s && !outstream)
 	{
 		fprintf(stderr, "The output stream has not been created\n");
-		if (!instream && !stdio_event)
-			start_context_drain(context);
+		if (input_done)
+			output_drained();
 		return;
 	}
 	if(pa_stream_get_state(s) == PA_STREAM_CREATING)
@@ -238,7 +783,6 @@ static void stream_state_callback(pa_stream *s, void *userdata)
 				pa_operation *o;
 
 				in_sample_spec = *pa_stream_get_sample_spec(s);
-				input_device_name = pa_stream_get_device_name(s);
 
 				if (!(o = pa_stream_update_timing_info(s, stream_timing_complete, NULL)))
 				{
@@ -254,6 +798,18 @@ static void stream_state_callback(pa_stream *s, void *userdata)
 
 		case PA_STREAM_FAILED:
 		default:
+			if(s == outstream && passthrough_codec != AV_CODEC_ID_NONE)
+			{
+				/* The decode thread finds the stream gone and decodes instead */
+				fprintf(stderr, "The sink does not take %s: %s\n", pa_encoding_to_string(passthrough_encoding), pa_strerror(pa_context_errno(pa_stream_get_context(s))));
+				passthrough_rejected |= 1u << passthrough_encoding;
+				pa_stream_set_state_callback(s, NULL, NULL);
+				pa_stream_set_write_callback(s, NULL, NULL);
+				pa_stream_unref(s);
+				outstream = NULL;
+				pa_threaded_mainloop_signal(mainloop, 0);
+				break;
+			}
 			fprintf(stderr, "Stream error: %s\n", pa_strerror(pa_context_errno(pa_stream_get_context(s))));
 			quit(1);
 	}
@@ -276,6 +832,8 @@ static void stream_underflow_callback(pa_stream *s, void *userdata)
 {
 	assert(s);
 
+	underruns++;
+
 	if (verbose)
 		fprintf(stderr, "Stream underrun.\n");
 }
@@ -284,6 +842,8 @@ static void stream_overflow_callback(pa_stream *s, void *userdata)
 {
 	assert(s);
 
+	overruns++;
+
 	if (verbose)
 		fprintf(stderr, "Stream overrun.\n");
 }
@@ -295,7 +855,7 @@ static void stream_started_callback(pa_stream *s, void *userdata)
 	if (verbose)
 		fprintf(stderr, "Stream started.\n");
 
-	if (!instream && !stdio_event)
+	if (input_done)
 		start_drain(s);
 	else
 	{
@@ -324,7 +884,6 @@ static void stream_moved_callback(pa_stream *s, void *userdata)
 	if(s == instream)
 	{
 		in_sample_spec = *pa_stream_get_sample_spec(s);
-		input_device_name = pa_stream_get_device_name(s);
 	}
 
 	if (!(o = pa_stream_update_timing_info(s, stream_timing_complete, NULL)))
@@ -369,246 +928,188 @@ static void stream_event_callback(pa_stream *s, const char *name, pa_proplist *p
 	pa_xfree(t);
 }
 
-/* Write some data to the stream */
-static void do_stream_write(pa_stream *s, size_t length)
+/* Write some data to the output */
+static void do_stream_write(size_t length)
 {
 	size_t l;
-
-	assert(s);
+	int r;
 
 	size_t out_frame_size = pa_frame_size(&out_sample_spec);
 
-	if (!outbuffer || !outbuffer_length || !length || !(l = ((length < outbuffer_length ? length : outbuffer_length) / out_frame_size) * out_frame_size))
+	if (!ringbuffer_length(&outbuffer) || !length || !(l = ((length < ringbuffer_length(&outbuffer) ? length : ringbuffer_length(&outbuffer)) / out_frame_size) * out_frame_size))
 		return;
 
-	if (pa_stream_write(s, (uint8_t*) outbuffer + outbuffer_index, l, NULL, 0, PA_SEEK_RELATIVE) < 0)
+	uint64_t t = trace_begin();
+	r = output->write(ringbuffer_read_ptr(&outbuffer), l);
+	trace_end("output_write", t);
+	if (r < 0)
 	{
-		fprintf(stderr, "pa_stream_write() failed: %s\n", pa_strerror(pa_context_errno(context)));
 		quit(1);
 		return;
 	}
 
-	outbuffer_length -= l;
-	outbuffer_index += l;
+	ringbuffer_drop(&outbuffer, l);
+}
+
+/* Gets a buffer owned by the output for at least min and at most max bytes of
+ * whole frames, so the data is written there directly and not copied again.
+ * Returns its size or 0 if the output cannot take that much now.
+ * Pending outbuffer data must go first, so this also fails while there is any */
+static size_t stream_begin_write(void **buf, size_t min, size_t max)
+{
+	size_t l;
+
+	size_t out_frame_size = pa_frame_size(&out_sample_spec);
+
+	if (ringbuffer_length(&outbuffer) || !(l = output->writable_size()))
+		return 0;
+
+	if (l > max)
+		l = max;
+	if (!(l = l / out_frame_size * out_frame_size) || l < min)
+		return 0;
 
-	if (!outbuffer_length)
+	if (output->begin_write(buf, &l) < 0)
 	{
-		pa_xfree(outbuffer);
-		outbuffer = NULL;
-		outbuffer_index = outbuffer_length = 0;
+		quit(1);
+		return 0;
 	}
-	else if(outbuffer_index > 4*1024)
+
+	if (!(l = l / out_frame_size * out_frame_size) || l < min)
 	{
-		memmove((uint8_t*) outbuffer, (uint8_t*) outbuffer + outbuffer_index, outbuffer_length);
-		outbuffer = pa_xrealloc(outbuffer, outbuffer_length);
-		outbuffer_index = 0;
+		output->cancel_write();
+		return 0;
 	}
+
+	return l;
 }
 
-/* This is called whenever new data may be written to the stream */
-static void stream_write_callback(pa_stream *s, size_t length, void *userdata)
+/* Hands l bytes of a buffer from stream_begin_write() back to the output */
+static size_t stream_commit_write(void *buf, size_t l)
 {
-	assert(s);
+	if (!l)
+	{
+		output->cancel_write();
+		return 0;
+	}
+
+	uint64_t t = trace_begin();
+	int r = output->write(buf, l);
+	trace_end("output_write", t);
+	if (r < 0)
+	{
+		quit(1);
+		return 0;
+	}
+
+	return l;
+}
+
+/* Write data to the output bypassing outbuffer. Returns the number of bytes consumed */
+static size_t do_stream_write_direct(const void *data, size_t length)
+{
+	void *buf;
+	size_t l;
+
+	if (!(l = stream_begin_write(&buf, 1, length)))
+		return 0;
+
+	memcpy(buf, data, l);
+
+	return stream_commit_write(buf, l);
+}
+
+/* PCM goes through pcm_swrcontext when pinned, or when the output cannot be
+ * played at a corrected rate and the converter has to make up for drift */
+static int pcm_converted(void)
+{
+	return pinned || (output->latency && !output->update_rate);
+}
+
+/* The latency controller steers the output of a live source, anything else
+ * is paced by the output already */
+static int latency_controlled(void)
+{
+	return (instream || capture || (replay_data && !replay_fast) || stdinbuffer.data) && passthrough_codec == AV_CODEC_ID_NONE;
+}
 
-	if (!length || !outbuffer)
+/* This is called whenever new data may be written to the output */
+static void output_write_callback(size_t length)
+{
+	if (!length || !ringbuffer_length(&outbuffer))
 		return;
 
-	if(tlength && outbuffer_length > tlength*2)
+	/* Drift is handled by the latency controller, this only catches up after
+	 * something it cannot correct in time, like the sink stalling */
+	uint32_t flush = latency_controlled() ? 8 : 2;
+	if(tlength && length < ringbuffer_length(&outbuffer) && ringbuffer_length(&outbuffer) > tlength*flush)
 	{
 #ifdef DEBUG_LATENCY
-		printf("Outbuffer is too long (%zu > %u*2). Flushing it to reduce latency. Sorry for that!\n", outbuffer_length, tlength);
+		fprintf(stderr, "Outbuffer is too long (%zu > %u*%u). Flushing it to reduce latency. Sorry for that!\n", ringbuffer_length(&outbuffer), tlength, flush);
 #endif
-		outbuffer_index += outbuffer_length - tlength;
-		outbuffer_length = tlength;
+		dropped_bytes += ringbuffer_length(&outbuffer) - tlength;
+		ringbuffer_drop(&outbuffer, ringbuffer_length(&outbuffer) - tlength);
 #ifdef DEBUG_LATENCY
-		printf("outbuffer_length = %zu\n", outbuffer_length);
+		fprintf(stderr, "outbuffer_length = %zu\n", ringbuffer_length(&outbuffer));
 #endif
 	}
 
-	do_stream_write(s, length);
+	do_stream_write(length);
+
+	/* The decode thread may be waiting for outbuffer to drain */
+	if (mainloop)
+		pa_threaded_mainloop_signal(mainloop, 0);
 }
 
-/* Maps FFMpeg sample format to PA sample format */
-enum pa_sample_format map_sample_format(enum AVSampleFormat format)
+static int output_open(void)
 {
-	const int isbe = (*(uint16_t *)"\0\xff" < 0x100) ? 1 : 0;
-	switch(av_get_packed_sample_fmt(format))
-	{
-		case AV_SAMPLE_FMT_U8:
-			return PA_SAMPLE_U8;
-		case AV_SAMPLE_FMT_S16:
-			return PA_SAMPLE_S16LE + isbe;
-		case AV_SAMPLE_FMT_S32:
-			return PA_SAMPLE_S32LE + isbe;
-		case AV_SAMPLE_FMT_FLT:
-			return PA_SAMPLE_FLOAT32LE + isbe;
-		case AV_SAMPLE_FMT_DBL:
-			fprintf(stderr, "PulseAudio does not support double float sample formats\n");
-		default:
-			fprintf(stderr, "Unexpected sample format %s\n", av_get_sample_fmt_name(format));
-	}
-	return PA_SAMPLE_INVALID;
+	return output->is_open();
 }
 
-void map_channel_layout(pa_channel_map* channel_map, AVChannelLayout* channel_layout)
+/* PulseAudio output backend */
+
+/* Built with the first stream, every stream gets a copy */
+static pa_proplist *out_proplist = NULL;
+
+static void stream_write_callback(pa_stream *s, size_t length, void *userdata)
 {
-	pa_channel_map_init(channel_map);
-	channel_map->channels = channel_layout->nb_channels;
+	assert(s);
 
-	int i;
-	for(i = 0; i < channel_map->channels; i++)
+	output_write_callback(length);
+}
+
+/* Sets up what every output stream shares, before it is created */
+static int pulse_prepare(const pa_sample_spec *spec)
+{
+	assert(context);
+
+	fprintf(stderr, "Setting target output latency to %zu usec (%u bytes)\n", (size_t)pa_bytes_to_usec(tlength, spec), tlength);
+
+	if (!out_proplist)
 	{
-		switch(av_channel_layout_channel_from_index(channel_layout, i))
+		if (!(out_proplist = pa_proplist_new()))
 		{
-			case AV_CHAN_FRONT_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT;
-				break;
-			case AV_CHAN_FRONT_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT;
-				break;
-			case AV_CHAN_FRONT_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_CENTER;
-				break;
-			case AV_CHAN_LOW_FREQUENCY:
-				channel_map->map[i] = PA_CHANNEL_POSITION_LFE;
-				break;
-			case AV_CHAN_BACK_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_LEFT;
-				break;
-			case AV_CHAN_BACK_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_RIGHT;
-				break;
-			case AV_CHAN_FRONT_LEFT_OF_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER;
-				break;
-			case AV_CHAN_FRONT_RIGHT_OF_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER;
-				break;
-			case AV_CHAN_BACK_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_CENTER;
-				break;
-			case AV_CHAN_SIDE_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
-				break;
-			case AV_CHAN_SIDE_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
-				break;
-			case AV_CHAN_TOP_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_CENTER;
-				break;
-			case AV_CHAN_TOP_FRONT_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_LEFT;
-				break;
-			case AV_CHAN_TOP_FRONT_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_CENTER;
-				break;
-			case AV_CHAN_TOP_FRONT_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_RIGHT;
-				break;
-			case AV_CHAN_TOP_BACK_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_LEFT;
-				break;
-			case AV_CHAN_TOP_BACK_CENTER:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_CENTER;
-				break;
-			case AV_CHAN_TOP_BACK_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_RIGHT;
-				break;
-			case AV_CHAN_STEREO_LEFT: //Stereo downmix
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT;
-				break;
-			case AV_CHAN_STEREO_RIGHT: //See AV_CHAN_STEREO_LEFT
-				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT;
-				break;
-			case AV_CHAN_WIDE_LEFT: // PA does not have wide speakers, so map them to side instead. If both of your setup and source have both wide and side speakers, you may want to change this to PA_CHANNEL_POSITION_AUX*. And if this is the case, please also send me a postcard.
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
-				break;
-			case AV_CHAN_WIDE_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
-				break;
-			case AV_CHAN_SURROUND_DIRECT_LEFT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
-				break;
-			case AV_CHAN_SURROUND_DIRECT_RIGHT:
-				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
-				break;
-			case AV_CHAN_LOW_FREQUENCY_2:
-				channel_map->map[i] = PA_CHANNEL_POSITION_LFE;
-				break;
-
-			default:
-				char channel_name[256];
-				char channel_layout_name[256];
-				if (av_channel_name(channel_name, sizeof(channel_name), av_channel_layout_channel_from_index(channel_layout, i)) >= sizeof(channel_name))
-					sprintf(channel_name, "Unknown");
-				if (av_channel_layout_describe(channel_layout, channel_layout_name, sizeof(channel_layout_name)) >= sizeof(channel_layout_name))
-					sprintf(channel_layout_name, "Unknown");
-				fprintf(stderr, "Unexpected channel %d position %s for layout %s\n", i, channel_name, channel_layout_name);
-				channel_map->map[i] = PA_CHANNEL_POSITION_INVALID;
+			fprintf(stderr, "pa_proplist_new() failed\n");
+			return -1;
 		}
+
+		pa_proplist_sets(out_proplist, PA_PROP_MEDIA_ROLE, "video");
 	}
+
+	return 0;
 }
 
-void open_output_stream(void)
+/* Connects the new outstream to the sink */
+static int pulse_connect(pa_stream_flags_t flags)
 {
-	pa_channel_map out_channel_map;
 	pa_buffer_attr buffer_attr;
 
-	assert(context);
-	assert(!outstream);
-
-	if(state == IEC61937)
-	{
-		out_sample_spec.format = map_sample_format(swroutformat);
-		out_sample_spec.rate = avcodeccontext->sample_rate;
-		map_channel_layout(&out_channel_map, &avcodeccontext->ch_layout);
-		out_sample_spec.channels = out_channel_map.channels;
-		tlength = avformatcontext->pb->buffer_size / 4 * out_bytes_per_sample * 2;
-	}
-	else
-	{
-		out_sample_spec.format = in_sample_spec.format;
-		out_sample_spec.rate = in_sample_spec.rate;
-		out_sample_spec.channels = in_sample_spec.channels;
-		if (instream)
-		{
-			memcpy(&out_channel_map, pa_stream_get_channel_map(instream), sizeof(pa_channel_map));
-			tlength = pa_stream_get_buffer_attr(instream)->fragsize;
-		}
-		else
-		{
-			pa_channel_map_init(&out_channel_map);
-			out_channel_map.channels = 2;
-			out_channel_map.map[0] = PA_CHANNEL_POSITION_FRONT_LEFT;
-			out_channel_map.map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT;
-			tlength = 16384;
-		}
-	}
-
-	fprintf(stderr, "Setting target output latency to %zu usec (%u bytes)\n", (size_t)pa_bytes_to_usec(tlength, &out_sample_spec), tlength);
-
 	buffer_attr.fragsize = (uint32_t) -1;
 	buffer_attr.maxlength = (uint32_t) -1;
 	buffer_attr.minreq = (uint32_t) -1;
 	buffer_attr.prebuf = (uint32_t) -1;
 	buffer_attr.tlength = tlength;
 
-	pa_proplist *proplist = pa_proplist_new();
-	if (!proplist) {
-		fprintf(stderr, "pa_proplist_new() failed\n");
-		quit(1);
-	}
-
-	pa_proplist_sets(proplist, PA_PROP_MEDIA_ROLE, "video");
-
-	if (!(outstream = pa_stream_new_with_proplist(context, "pareceive output stream", &out_sample_spec, &out_channel_map, proplist)))
-	{
-		fprintf(stderr, "pa_stream_new_with_proplist() failed: %s\n", pa_strerror(pa_context_errno(context)));
-		quit(1);
-	}
-
-	pa_proplist_free(proplist);
-
 	pa_stream_set_state_callback(outstream, stream_state_callback, NULL);
 	pa_stream_set_write_callback(outstream, stream_write_callback, NULL);
 	pa_stream_set_suspended_callback(outstream, stream_suspended_callback, NULL);
@@ -619,507 +1120,3875 @@ void open_output_stream(void)
 	pa_stream_set_event_callback(outstream, stream_event_callback, NULL);
 	pa_stream_set_buffer_attr_callback(outstream, stream_buffer_attr_callback, NULL);
 
-	if (pa_stream_connect_playback(outstream, outdevice, &buffer_attr, outflags, NULL, NULL) < 0)
+	if (pa_stream_connect_playback(outstream, outdevice, &buffer_attr, flags, NULL, NULL) < 0)
 	{
 		fprintf(stderr, "pa_stream_connect_playback() failed: %s\n", pa_strerror(pa_context_errno(context)));
-		quit(1);
+		return -1;
 	}
+
+	return 0;
 }
 
-static int readFunction(void* opaque, uint8_t* buf, int buf_size)
+static int pulse_open(const pa_sample_spec *spec, const pa_channel_map *map)
 {
-	size_t l = buf_size;
+	if (pulse_prepare(spec) < 0)
+		return -1;
+
+	outstream = pa_stream_new_with_proplist(context, "pareceive output stream", spec, map, out_proplist);
 
-	if (!inbuffer)
-		return AVERROR_EOF;
+	if (!outstream)
+	{
+		fprintf(stderr, "pa_stream_new_with_proplist() failed: %s\n", pa_strerror(pa_context_errno(context)));
+		return -1;
+	}
+
+	return pulse_connect(outflags);
+}
+
+/* Whether the sink takes the encoding is only known once the stream connects.
+ * Encoded streams cannot be resampled, so drift is not corrected either */
+static int pulse_open_passthrough(pa_encoding_t encoding, const pa_sample_spec *spec)
+{
+	pa_format_info *format;
 
-	if (inbuffer_length < l)
-		return AVERROR_EOF;
+	if (pulse_prepare(spec) < 0)
+		return -1;
 
-	memcpy(buf, (uint8_t*) inbuffer + inbuffer_index, l);
+	format = pa_format_info_new();
+	format->encoding = encoding;
+	pa_format_info_set_rate(format, spec->rate);
+	pa_format_info_set_channels(format, spec->channels);
 
-	inbuffer_length -= (uint32_t) l;
-	inbuffer_index += (uint32_t) l;
+	outstream = pa_stream_new_extended(context, "pareceive passthrough stream", &format, 1, out_proplist);
+	pa_format_info_free(format);
 
-	if (!inbuffer_length)
+	if (!outstream)
 	{
-		pa_xfree(inbuffer);
-		inbuffer = NULL;
-		inbuffer_length = inbuffer_index = 0;
+		fprintf(stderr, "pa_stream_new_extended() failed: %s\n", pa_strerror(pa_context_errno(context)));
+		return -1;
 	}
-	else if(inbuffer_index > 4*1024)
+
+	if (pulse_connect(outflags & ~PA_STREAM_VARIABLE_RATE) < 0)
 	{
-		memmove((uint8_t*) inbuffer, (uint8_t*) inbuffer + inbuffer_index, inbuffer_length);
-		inbuffer = pa_xrealloc(inbuffer, inbuffer_length);
-		inbuffer_index = 0;
+		pa_stream_unref(outstream);
+		outstream = NULL;
+		return -1;
 	}
 
-	return l;
+	return 0;
 }
 
-void print_averror(const char *str, int err)
+static void pulse_close(void)
 {
-	char errbuf[128];
-	const char *errbuf_ptr = errbuf;
+	pa_stream_set_write_callback(outstream, NULL, NULL);
+	start_drain(outstream);
+	outstream = NULL;
+}
 
-	if (av_strerror(err, errbuf, sizeof(errbuf)) < 0)
-		errbuf_ptr = strerror(AVUNERROR(err));
+static int pulse_is_open(void)
+{
+	return outstream != NULL;
+}
 
-	fprintf(stderr, "%s: %s\n", str, errbuf_ptr);
+static size_t pulse_writable_size(void)
+{
+	if (!outstream || pa_stream_get_state(outstream) != PA_STREAM_READY)
+		return 0;
+
+	return pa_stream_writable_size(outstream);
 }
 
-void set_instream_fragsize(uint32_t fragsize)
+static int pulse_begin_write(void **buf, size_t *l)
 {
-	fprintf(stderr, "Setting target input latency to %zu usec (%u bytes)\n", (size_t)pa_bytes_to_usec(fragsize, &in_sample_spec), fragsize);
-	if(instream)
-	{
-		pa_buffer_attr buffer_attr;
-		memcpy(&buffer_attr, pa_stream_get_buffer_attr(instream), sizeof(pa_buffer_attr));
-		buffer_attr.fragsize = fragsize;
-		pa_operation_unref(pa_stream_set_buffer_attr(instream, &buffer_attr, stream_set_buffer_attr_callback, NULL));
-	}
-	else
+	if (pa_stream_begin_write(outstream, buf, l) < 0)
 	{
-		stdin_fragsize = fragsize == (uint32_t) -1 ? MAX_STDIN_READ : fragsize;
-		if(stdin_fragsize > MAX_STDIN_READ)
-			stdin_fragsize = MAX_STDIN_READ;
+		fprintf(stderr, "pa_stream_begin_write() failed: %s\n", pa_strerror(pa_context_errno(context)));
+		return -1;
 	}
+
+	return 0;
 }
 
-void set_state(enum state newstate)
+static void pulse_cancel_write(void)
 {
-	enum state oldstate = state;
-
-	if(oldstate == newstate)
-		return;
+	pa_stream_cancel_write(outstream);
+}
 
-	if (outstream)
+static int pulse_write(const void *data, size_t l)
+{
+	if (pa_stream_write(outstream, data, l, NULL, 0, PA_SEEK_RELATIVE) < 0)
 	{
-		if(pa_stream_get_state(outstream) == PA_STREAM_READY)
-			stream_write_callback(outstream, pa_stream_writable_size(outstream), NULL);
-		pa_stream_set_write_callback(outstream, NULL, NULL);
-		start_drain(outstream);
-		outstream = NULL;
-		out_sample_spec = in_sample_spec;
-		fprintf(stderr, "Closed output stream\n");
+		fprintf(stderr, "pa_stream_write() failed: %s\n", pa_strerror(pa_context_errno(context)));
+		return -1;
 	}
 
-	if (outbuffer)
-	{
-		pa_xfree(outbuffer);
-		outbuffer = NULL;
-		outbuffer_index = outbuffer_length = 0;
-	}
+	return 0;
+}
 
-	switch(oldstate)
-	{
-		case NOSIGNAL:
-			break;
-		case PCM:
-			break;
-		case IEC61937:
-			if(avformatcontext)
-			{
-				av_free(avformatcontext->pb->buffer);
-				av_free(avformatcontext->pb);
-				avformat_close_input(&avformatcontext);
-				avcodec_free_context(&avcodeccontext);
-				swr_free(&swrcontext);
-				avformat_free_context(avformatcontext);
-				avformatcontext = NULL;
-				out_bytes_per_sample = 4;
-			}
+static void pulse_drain(void)
+{
+	start_drain(outstream);
+}
 
-			if(inbuffer)
-			{
-					if(newstate == PCM)
-					{
-				   		outbuffer = pa_xrealloc(outbuffer, outbuffer_index + outbuffer_length + inbuffer_length);
-				   		memcpy((uint8_t*) outbuffer + outbuffer_index + outbuffer_length, (uint8_t*) inbuffer + inbuffer_index, inbuffer_length);
-				   		outbuffer_length += inbuffer_length;
-					}
+static int pulse_latency(pa_usec_t *usec)
+{
+	int negative;
 
-		  			pa_xfree(inbuffer);
-	  				inbuffer = NULL;
-	  				inbuffer_index = inbuffer_length = 0;
-			}
-			break;
-	}
+	if (!outstream || pa_stream_get_state(outstream) != PA_STREAM_READY || pa_stream_is_corked(outstream) || pa_stream_get_latency(outstream, usec, &negative) < 0)
+		return -1;
 
-	state = newstate;
+	if (negative)
+		*usec = 0;
+	return 0;
+}
 
-	switch(newstate)
-	{
-		case NOSIGNAL:
-			set_instream_fragsize(SILENCE_CHECK_SIZE);
-			break;
-		case PCM:
-			fprintf(stderr, "Playing PCM\n");
-			open_output_stream();
-			break;
-		case IEC61937:
-			break;
-	}
+static int pulse_update_rate(uint32_t rate)
+{
+	pa_operation *o = pa_stream_update_sample_rate(outstream, rate, NULL, NULL);
+
+	if (!o)
+		return -1;
+
+	pa_operation_unref(o);
+	return 0;
 }
 
-#define SPDIF_MAX_OFFSET 16384*10
+static void pulse_free(void)
+{
+	if (out_proplist)
+		pa_proplist_free(out_proplist);
+	out_proplist = NULL;
+}
 
-// returns 0 if data is too small for examination, 1 if validation fails and a block size (aka offset) if validation is successful
-size_t iec61937_validate(const uint8_t* data, size_t length)
+static const struct output_backend pulse_output =
 {
-	static const uint32_t magic = 0x4E1FF872;
-	size_t firstmagic, secondmagic;
+	.open = pulse_open,
+	.close = pulse_close,
+	.is_open = pulse_is_open,
+	.writable_size = pulse_writable_size,
+	.begin_write = pulse_begin_write,
+	.cancel_write = pulse_cancel_write,
+	.write = pulse_write,
+	.drain = pulse_drain,
+	.free = pulse_free,
+	.open_passthrough = pulse_open_passthrough,
+	.latency = pulse_latency,
+	.update_rate = pulse_update_rate,
+};
 
-	for(firstmagic = 0; firstmagic < length-sizeof(uint32_t)+1; firstmagic++)
-		if(*(uint32_t*)(data+firstmagic) == magic)
-			break;
+/* The null and file backends take any amount of data, begin_write() hands
+ * out a scratch buffer big enough for a few decoded frames */
+static int sink_is_open = 0;
+static pa_sample_spec sink_spec;
+static uint8_t *sink_buffer = NULL;
+static size_t sink_buffer_size = 0;
+static size_t sink_written = 0;		/* by the current stream */
+static uint64_t sink_bytes = 0;		/* by all of them */
 
-	if(firstmagic == length-sizeof(uint32_t)+1)
-	{
-		if(length < SPDIF_MAX_OFFSET)
-			return 0;
-		else
-			return 1;
-	}
+static void print_output_spec(const pa_sample_spec *spec, const pa_channel_map *map)
+{
+	char cmt[PA_CHANNEL_MAP_SNPRINT_MAX], sst[PA_SAMPLE_SPEC_SNPRINT_MAX];
 
-	for(secondmagic = firstmagic + ((*(uint16_t*)(data+firstmagic+6))>>3) + 8; secondmagic < length-sizeof(uint32_t)+1; secondmagic++)
-		if(*(uint32_t*)(data+secondmagic) == magic)
-			break;
+	if (verbose)
+		fprintf(stderr, "Using sample spec '%s', channel map '%s'.\n",
+				pa_sample_spec_snprint(sst, sizeof(sst), spec),
+				pa_channel_map_snprint(cmt, sizeof(cmt), map));
+}
 
-	if(secondmagic == length-sizeof(uint32_t)+1)
+static void sink_open(const pa_sample_spec *spec, const pa_channel_map *map)
+{
+	if (sink_buffer_size < (size_t)tlength * 4)
 	{
-		if(length < SPDIF_MAX_OFFSET * 2)
-			return 0;
-		else
-			return 1;
+		sink_buffer_size = (size_t)tlength * 4;
+		sink_buffer = pa_xrealloc(sink_buffer, sink_buffer_size);
 	}
 
-	secondmagic -= firstmagic;
+	sink_spec = *spec;
+	sink_written = 0;
+	sink_is_open = 1;
 
-	if(secondmagic > SPDIF_MAX_OFFSET)
-		return 1;
+	print_output_spec(spec, map);
+}
 
-	if(length < secondmagic * 2)
-		return 0;
+static int sink_open_get(void)
+{
+	return sink_is_open;
+}
+
+static int sink_begin_write(void **buf, size_t *l)
+{
+	if (*l > sink_buffer_size)
+		*l = sink_buffer_size;
 
-	return secondmagic;
+	*buf = sink_buffer;
+	return 0;
 }
 
-//returns 1 if magic found, 0 if not
-int iec61937_suspect(const uint8_t* data, size_t length)
+static void sink_cancel_write(void)
 {
-	static const uint32_t magic = 0x4E1FF872;
-	size_t firstmagic;
+}
 
-	for(firstmagic = 0; firstmagic < length-sizeof(uint32_t)+1; firstmagic++)
-		if(*(uint32_t*)(data+firstmagic) == magic)
-			break;
+static void sink_free(void)
+{
+	pa_xfree(sink_buffer);
+	sink_buffer = NULL;
+	sink_buffer_size = 0;
+}
+
+/* Null output backend: discards the data, either at the rate it would be
+ * played at or as fast as it comes */
+#define NULL_SINK_PERIOD 10000	/* usec */
+static int null_fast = 0;
+static uint64_t null_start = 0;	/* nsec, CLOCK_MONOTONIC */
+static pa_time_event *null_event = NULL;
 
-	return (firstmagic == length-sizeof(uint32_t)+1) ? 0 : 1;
+/* Plays the sink's share of wall-clock time */
+static void null_timer_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+	struct timeval next;
+
+	a->time_restart(e, pa_timeval_add(pa_gettimeofday(&next), NULL_SINK_PERIOD));
+
+	output_write_callback(output->writable_size());
 }
 
-/* Process new data */
-static void decode_data(const void *data, size_t length, void *userdata)
+static int null_open(const pa_sample_spec *spec, const pa_channel_map *map)
 {
-	int i=0;
-	static size_t prevextralength = 0;
+	sink_open(spec, map);
+	null_start = trace_now();
 
-	assert(data);
-	assert(length > 0);
+	if (!null_fast && mainloop_api)
+	{
+		struct timeval tv;
+		null_event = mainloop_api->time_new(mainloop_api, pa_timeval_add(pa_gettimeofday(&tv), NULL_SINK_PERIOD), null_timer_callback, NULL);
+	}
 
-	if(state==NOSIGNAL)
+	return 0;
+}
+
+static void null_close(void)
+{
+	if (null_event)
 	{
-		for(i=0; i<length/sizeof(uint32_t); i++)
-			if(((uint32_t*) data)[i])
-				break;
-		if(i<length/sizeof(uint32_t))
-			set_state(IEC61937);
+		mainloop_api->time_free(null_event);
+		null_event = NULL;
 	}
-	else
+
+	sink_is_open = 0;
+}
+
+/* Up to tlength ahead of the wall clock, like a sink buffer would be */
+static size_t null_writable_size(void)
+{
+	if (!sink_is_open)
+		return 0;
+
+	if (null_fast)
+		return (size_t)-1;
+
+	size_t played = pa_usec_to_bytes((trace_now() - null_start) / 1000, &sink_spec) + tlength;
+
+	return played > sink_written ? played - sink_written : 0;
+}
+
+static int null_write(const void *data, size_t l)
+{
+	sink_written += l;
+	sink_bytes += l;
+	return 0;
+}
+
+static void null_drain(void)
+{
+	if (sink_is_open)
 	{
-		static pa_usec_t silence=0;
-		for(i=0; i<length/sizeof(uint32_t); i++)
-			if(((uint32_t*) data)[i])
-				break;
-		if(i<length/sizeof(uint32_t))
-		{
-			silence = 0;
-		}
-		else
+		do_stream_write(ringbuffer_length(&outbuffer));
+		null_close();
+	}
+
+	output_drained();
+}
+
+static const struct output_backend null_output =
+{
+	.open = null_open,
+	.close = null_close,
+	.is_open = sink_open_get,
+	.writable_size = null_writable_size,
+	.begin_write = sink_begin_write,
+	.cancel_write = sink_cancel_write,
+	.write = null_write,
+	.drain = null_drain,
+	.free = sink_free,
+};
+
+/* File output backend: raw samples, or a WAV file. Streams of the same
+ * format go on in the same file, a WAV file gets a new numbered one for
+ * every format change */
+static const char *file_path = NULL;	/* - is stdout */
+static int file_wav = 0;
+static int file_fd = -1;
+static struct ringbuffer file_pending = {0};	/* what a full pipe did not take yet */
+static pa_io_event *file_event = NULL;
+static int file_draining = 0;
+static unsigned file_segment = 0;
+static pa_sample_spec file_spec;
+static pa_channel_map file_map;
+
+#define WAV_HEADER_SIZE 68
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+/* WAVE_FORMAT_EXTENSIBLE speaker mask, 0 if the map has positions WAV has no bits for */
+static uint32_t wav_channel_mask(const pa_channel_map *map)
+{
+	uint32_t mask = 0, bit;
+	unsigned i;
+
+	for (i = 0; i < map->channels; i++)
+	{
+		switch (map->map[i])
 		{
-			silence+=pa_bytes_to_usec(length, &in_sample_spec);
-			if(silence > 100000)
-			{
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				silence=0;
-				return;
-			}
+			case PA_CHANNEL_POSITION_FRONT_LEFT: bit = 0x1; break;
+			case PA_CHANNEL_POSITION_FRONT_RIGHT: bit = 0x2; break;
+			case PA_CHANNEL_POSITION_MONO:
+			case PA_CHANNEL_POSITION_FRONT_CENTER: bit = 0x4; break;
+			case PA_CHANNEL_POSITION_LFE: bit = 0x8; break;
+			case PA_CHANNEL_POSITION_REAR_LEFT: bit = 0x10; break;
+			case PA_CHANNEL_POSITION_REAR_RIGHT: bit = 0x20; break;
+			case PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER: bit = 0x40; break;
+			case PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER: bit = 0x80; break;
+			case PA_CHANNEL_POSITION_REAR_CENTER: bit = 0x100; break;
+			case PA_CHANNEL_POSITION_SIDE_LEFT: bit = 0x200; break;
+			case PA_CHANNEL_POSITION_SIDE_RIGHT: bit = 0x400; break;
+			case PA_CHANNEL_POSITION_TOP_CENTER: bit = 0x800; break;
+			case PA_CHANNEL_POSITION_TOP_FRONT_LEFT: bit = 0x1000; break;
+			case PA_CHANNEL_POSITION_TOP_FRONT_CENTER: bit = 0x2000; break;
+			case PA_CHANNEL_POSITION_TOP_FRONT_RIGHT: bit = 0x4000; break;
+			case PA_CHANNEL_POSITION_TOP_REAR_LEFT: bit = 0x8000; break;
+			case PA_CHANNEL_POSITION_TOP_REAR_CENTER: bit = 0x10000; break;
+			case PA_CHANNEL_POSITION_TOP_REAR_RIGHT: bit = 0x20000; break;
+			default: return 0;
 		}
-		i=0;
+
+		/* The channels must come in the order of their bits */
+		if (bit <= mask)
+			return 0;
+		mask |= bit;
 	}
 
-	if(state==IEC61937)
+	return mask;
+}
+
+/* Builds a WAVE_FORMAT_EXTENSIBLE header. The sizes are the largest possible
+ * until the stream is closed, which is what readers expect from a pipe */
+static int wav_header(uint8_t *h, const pa_sample_spec *spec, const pa_channel_map *map, uint32_t data_size)
+{
+	static const uint8_t subformat_tail[14] = {0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71};
+	unsigned bits, valid_bits, format = 1;
+
+	switch (spec->format)
 	{
-   		inbuffer = pa_xrealloc(inbuffer, inbuffer_index + inbuffer_length + length - i*sizeof(uint32_t));
-   		memcpy((uint8_t*) inbuffer + inbuffer_index + inbuffer_length, (uint32_t*) data + i, length - i*sizeof(uint32_t));
-   		inbuffer_length += length - i*sizeof(uint32_t);
+		case PA_SAMPLE_U8: bits = valid_bits = 8; break;
+		case PA_SAMPLE_S16LE: bits = valid_bits = 16; break;
+		case PA_SAMPLE_S24LE: bits = valid_bits = 24; break;
+		case PA_SAMPLE_S24_32LE: bits = 32; valid_bits = 24; break;
+		case PA_SAMPLE_S32LE: bits = valid_bits = 32; break;
+		case PA_SAMPLE_FLOAT32LE: bits = valid_bits = 32; format = 3; break;
+		default:
+			fprintf(stderr, "Sample format %s cannot be stored in a WAV file\n", pa_sample_format_to_string(spec->format));
+			return -1;
+	}
+
+	memcpy(h, "RIFF", 4);
+	put_le32(h + 4, data_size > UINT32_MAX - (WAV_HEADER_SIZE - 8) ? UINT32_MAX : data_size + WAV_HEADER_SIZE - 8);
+	memcpy(h + 8, "WAVEfmt ", 8);
+	put_le32(h + 16, 40);
+	put_le16(h + 20, 0xFFFE);
+	put_le16(h + 22, spec->channels);
+	put_le32(h + 24, spec->rate);
+	put_le32(h + 28, spec->rate * (bits / 8) * spec->channels);
+	put_le16(h + 32, (bits / 8) * spec->channels);
+	put_le16(h + 34, bits);
+	put_le16(h + 36, 22);
+	put_le16(h + 38, valid_bits);
+	put_le32(h + 40, wav_channel_mask(map));
+	put_le16(h + 44, format);
+	memcpy(h + 46, subformat_tail, sizeof(subformat_tail));
+	memcpy(h + 60, "data", 4);
+	put_le32(h + 64, data_size);
+
+	return 0;
+}
+
+static void file_close(void);
+
+/* A full non-blocking pipe has room again: writes what waited for it, then
+ * lets the output go on or finishes draining */
+static void file_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+{
+	ssize_t r;
 
-		if(!avformatcontext)
+	while (ringbuffer_length(&file_pending))
+	{
+		if ((r = write(file_fd, ringbuffer_read_ptr(&file_pending), ringbuffer_length(&file_pending))) < 0)
 		{
-			size_t block_size = iec61937_validate((uint8_t*) inbuffer + inbuffer_index, inbuffer_length);
-			if (block_size == 0)
-			{
-#ifdef DEBUG_LATENCY
-				fprintf(stderr, "Buffer is too small, waiting for more data\n");
-#endif
-				return;
-			}
-			else if(block_size == 1)
-			{
-				fprintf(stderr, "IEC61937 validation failed\n");
-				set_state(PCM);
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
 				return;
-			}
+			fprintf(stderr, "write() to %s failed: %s\n", file_path, strerror(errno));
+			quit(1);
+			return;
+		}
 
-#ifdef DEBUG_LATENCY
-			fprintf(stderr, "block_size=%zu\n", block_size);
-#endif
-	
-			if(inbuffer_length < block_size * 3)
-			{
-#ifdef DEBUG_LATENCY
-				fprintf(stderr, "Buffer is too small, waiting for more data\n");
-#endif
-				return;
-			}
+		ringbuffer_drop(&file_pending, r);
+	}
 
-			prevextralength = inbuffer_length;
+	a->io_enable(e, PA_IO_EVENT_NULL);
 
-			avformatcontext = avformat_alloc_context();
-			avformatcontext->pb = avio_alloc_context(av_malloc(block_size), block_size, 0, NULL, readFunction, NULL, NULL);
-			if( (i = avformat_open_input(&avformatcontext, input_device_name, av_find_input_format("spdif"), NULL)) < 0)
-			{
-				print_averror("avformat_open_input", i);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
+	if (file_draining)
+	{
+		file_draining = 0;
+		file_close();
+		output_drained();
+	}
+	else
+		output_write_callback(output->writable_size());
+}
 
-			if( (i=avformat_find_stream_info(avformatcontext, NULL)) < 0)
-			{
-				print_averror("avformat_find_stream_info", i);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
+/* Writes what the file takes without blocking the mainloop. If it is a full
+ * non-blocking pipe, the rest waits in file_pending for file_callback() */
+static int file_write_all(const void *data, size_t l)
+{
+	const uint8_t *p = data;
+	ssize_t r;
 
-			//av_dump_format(avformatcontext, 0, input_device_name, 0);
+	while (l && !ringbuffer_length(&file_pending))
+	{
+		if ((r = write(file_fd, p, l)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN)
+				break;
+			fprintf(stderr, "write() to %s failed: %s\n", file_path, strerror(errno));
+			return -1;
+		}
 
-			const AVCodec *dec = NULL;
-			int stream_index = av_find_best_stream(avformatcontext, AVMEDIA_TYPE_AUDIO, -1, -1, &dec, 0);
+		p += r;
+		l -= r;
+	}
 
-			if(stream_index < 0)
-			{
-				print_averror("av_find_best_stream", stream_index);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
+	if (!l)
+		return 0;
 
-			avcodeccontext = avcodec_alloc_context3(dec); 	
+	ringbuffer_write(&file_pending, p, l);
 
-			avcodec_parameters_to_context(avcodeccontext,avformatcontext->streams[stream_index]->codecpar);
+	if (!file_event && !(file_event = mainloop_api->io_new(mainloop_api, file_fd, PA_IO_EVENT_OUTPUT, file_callback, NULL)))
+	{
+		fprintf(stderr, "io_new() failed.\n");
+		return -1;
+	}
+	mainloop_api->io_enable(file_event, PA_IO_EVENT_OUTPUT);
 
-			if ((i = avcodec_open2(avcodeccontext, dec, NULL)) < 0)
-			{
-				print_averror("avcodec_open2", i);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
+	return 0;
+}
 
-			swroutformat = av_get_packed_sample_fmt(avcodeccontext->sample_fmt);
-			if(swroutformat == AV_SAMPLE_FMT_DBL)
-				swroutformat = AV_SAMPLE_FMT_FLT;
-			if ((i = swr_alloc_set_opts2(&swrcontext,
-											&avcodeccontext->ch_layout,
-											swroutformat,
-											avcodeccontext->sample_rate,
-											&avcodeccontext->ch_layout,
-											avcodeccontext->sample_fmt,
-											avcodeccontext->sample_rate,
-											0, NULL)) < 0)
-			{
-				print_averror("swr_alloc_set_opts2", i);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
-			swr_init(swrcontext);
+static void file_close_fd(void)
+{
+	if (file_event)
+	{
+		mainloop_api->io_free(file_event);
+		file_event = NULL;
+	}
+
+	if (file_fd > STDOUT_FILENO)
+		close(file_fd);
+	file_fd = -1;
+}
 
-			out_bytes_per_sample = av_get_bytes_per_sample(swroutformat) * (size_t)avcodeccontext->ch_layout.nb_channels;
+/* Puts the real sizes into the WAV header if the file can be seeked */
+static void file_finish(void)
+{
+	uint8_t h[WAV_HEADER_SIZE];
+	off_t end;
 
-			pkt->data = NULL;
-			pkt->size = 0;
+	if (file_fd < 0 || !file_wav || (end = lseek(file_fd, 0, SEEK_CUR)) < WAV_HEADER_SIZE)
+		return;
 
-			set_instream_fragsize(block_size * 2);
+	if (wav_header(h, &file_spec, &file_map, end - WAV_HEADER_SIZE > UINT32_MAX ? UINT32_MAX : end - WAV_HEADER_SIZE) < 0)
+		return;
 
-			open_output_stream();
+	if (pwrite(file_fd, h, sizeof(h), 0) != sizeof(h))
+		fprintf(stderr, "Cannot update the WAV header of %s: %s\n", file_path, strerror(errno));
+}
 
-			char buf[256];
-			avcodec_string(buf, sizeof(buf), avcodeccontext, 0);
-			fprintf(stderr, "Playing IEC61937: %s\n", buf);
-		}
+static void file_free(void)
+{
+	file_finish();
+	file_close_fd();
+	ringbuffer_free(&file_pending);
+	sink_free();
+}
+
+static int file_open(const pa_sample_spec *spec, const pa_channel_map *map)
+{
+	if (file_fd >= 0 && file_wav && (!pa_sample_spec_equal(spec, &file_spec) || !pa_channel_map_equal(map, &file_map)))
+	{
+		file_finish();
+		file_close_fd();
+		file_segment++;
 	}
 
-	if(state==IEC61937 && inbuffer_length > avformatcontext->pb->buffer_size * 2)
+	if (file_fd < 0)
 	{
-		int pcount=0, fcount=0;
-		while ( inbuffer_length > avformatcontext->pb->buffer_size * 2 && (i = av_read_frame(avformatcontext, pkt)) >= 0)
+		if (!strcmp(file_path, "-"))
 		{
-			pcount++;
-			int ret = avcodec_send_packet(avcodeccontext, pkt);
-			av_packet_unref(pkt);
-			if(ret<0)
+			if (file_segment)
 			{
-				print_averror("avcodec_send_packet", ret);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
+				fprintf(stderr, "The WAV format on stdout cannot change\n");
+				return -1;
 			}
-			while ( (ret = avcodec_receive_frame(avcodeccontext, avframe)) >=0)
-			{
-				size_t addlen = swr_get_out_samples(swrcontext, avframe->nb_samples) * out_bytes_per_sample;
-   				outbuffer = pa_xrealloc(outbuffer, outbuffer_index + outbuffer_length + addlen);
-				uint8_t *outptr = (uint8_t*) outbuffer + outbuffer_length;
-				outbuffer_length += swr_convert(swrcontext, &outptr, addlen, (const uint8_t **) avframe->extended_data, avframe->nb_samples) * out_bytes_per_sample;
+			file_fd = STDOUT_FILENO;
 
-				fcount++;
-				av_frame_unref(avframe);
-			}
-			if(ret != AVERROR(EAGAIN))
-			{
-				print_averror("avcodec_receive_frame", ret);
-				fprintf(stderr, "Playing silence\n");
-				set_state(NOSIGNAL);
-				return;
-			}
+			/* A pipe to a slow reader must not stall the mainloop */
+			struct stat st;
+			if (!fstat(file_fd, &st) && S_ISFIFO(st.st_mode))
+				fcntl(file_fd, F_SETFL, fcntl(file_fd, F_GETFL) | O_NONBLOCK);
 		}
-
-		static int total_missed_frames=0;
-
-		if((!pcount || i != 0) && i != AVERROR_EOF)
+		else
 		{
-			print_averror("av_read_frame", i);
-			total_missed_frames = 0;
-			prevextralength = 0;
-			fprintf(stderr, "Playing silence\n");
-			set_state(NOSIGNAL);
-			return;
+			char *path = NULL;
+			const char *ext = strrchr(file_path, '.');
+
+			/* out.wav, out-1.wav, out-2.wav... */
+			if ((!file_segment ? asprintf(&path, "%s", file_path)
+					: ext && !strchr(ext, '/') ? asprintf(&path, "%.*s-%u%s", (int)(ext - file_path), file_path, file_segment, ext)
+					: asprintf(&path, "%s-%u", file_path, file_segment)) < 0)
+				return -1;
+
+			file_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (file_fd < 0)
+				fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+			else if (verbose)
+				fprintf(stderr, "Writing to %s\n", path);
+			free(path);
+
+			if (file_fd < 0)
+				return -1;
 		}
 
-		int missed_frames = (length+prevextralength) / avformatcontext->pb->buffer_size;
-		prevextralength += length - (unsigned long)missed_frames * avformatcontext->pb->buffer_size;
-		missed_frames -= fcount;
-		if (missed_frames < 0)
+		file_spec = *spec;
+		file_map = *map;
+
+		if (file_wav)
 		{
-			missed_frames = 0;
-			prevextralength = 0;
+			uint8_t h[WAV_HEADER_SIZE];
+
+			if (wav_header(h, spec, map, UINT32_MAX) < 0 || file_write_all(h, sizeof(h)) < 0)
+				return -1;
 		}
+	}
 
-		total_missed_frames += missed_frames;
-		if(!missed_frames)
-			total_missed_frames = 0;
+	sink_open(spec, map);
 
-		if(total_missed_frames > 32)
+	return 0;
+}
+
+static void file_close(void)
+{
+	sink_is_open = 0;
+	file_finish();
+}
+
+/* Nothing goes in while a full pipe holds the output up */
+static size_t file_writable_size(void)
+{
+	return sink_is_open && !ringbuffer_length(&file_pending) ? (size_t)-1 : 0;
+}
+
+static int file_write(const void *data, size_t l)
+{
+	sink_written += l;
+	sink_bytes += l;
+	return file_write_all(data, l);
+}
+
+static void file_drain(void)
+{
+	if (sink_is_open)
+	{
+		do_stream_write(ringbuffer_length(&outbuffer));
+
+		/* file_callback() finishes once the pipe has taken the rest */
+		if (ringbuffer_length(&file_pending))
 		{
-			fprintf(stderr, "Too many missed frames\n");
-			total_missed_frames = 0;
-			prevextralength = 0;
-			fprintf(stderr, "Playing silence\n");
-			set_state(NOSIGNAL);
+			file_draining = 1;
 			return;
 		}
+
+		file_close();
 	}
-#ifdef DEBUG_LATENCY
-	else if(state==IEC61937)
+
+	output_drained();
+}
+
+static const struct output_backend file_output =
+{
+	.open = file_open,
+	.close = file_close,
+	.is_open = sink_open_get,
+	.writable_size = file_writable_size,
+	.begin_write = sink_begin_write,
+	.cancel_write = sink_cancel_write,
+	.write = file_write,
+	.drain = file_drain,
+	.free = file_free,
+};
+
+static pa_io_event_flags_t poll_to_io_flags(short events)
+{
+	return (events & POLLIN ? PA_IO_EVENT_INPUT : 0) | (events & POLLOUT ? PA_IO_EVENT_OUTPUT : 0) |
+		(events & POLLHUP ? PA_IO_EVENT_HANGUP : 0) | (events & POLLERR ? PA_IO_EVENT_ERROR : 0);
+}
+
+static short io_flags_to_poll(pa_io_event_flags_t f)
+{
+	return (f & PA_IO_EVENT_INPUT ? POLLIN : 0) | (f & PA_IO_EVENT_OUTPUT ? POLLOUT : 0) |
+		(f & PA_IO_EVENT_HANGUP ? POLLHUP : 0) | (f & PA_IO_EVENT_ERROR ? POLLERR : 0);
+}
+
+/* ALSA output backend: decoded frames go straight into the mmap'd hardware
+ * buffer, which is only as deep as --period and --buffer ask for */
+#define PLAYBACK_PERIOD 1000		/* usec */
+#define PLAYBACK_BUFFER 4000		/* usec */
+static const char *playback_device = NULL;
+static snd_pcm_t *playback = NULL;
+static pa_usec_t playback_period_usec = PLAYBACK_PERIOD, playback_buffer_usec = PLAYBACK_BUFFER;
+static snd_pcm_uframes_t playback_buffer = 0;
+static size_t playback_frame_size = 0;
+static struct pollfd *playback_fds = NULL;
+static pa_io_event **playback_events = NULL;
+static int playback_nfds = 0;
+static int playback_waiting = 0;	/* poll events are on */
+static int playback_draining = 0;
+static void *playback_mmap_buf = NULL;	/* handed out by begin_write() */
+static snd_pcm_uframes_t playback_mmap_offset = 0;
+
+static snd_pcm_format_t playback_format(pa_sample_format_t format)
+{
+	switch (format)
+	{
+		case PA_SAMPLE_U8:
+			return SND_PCM_FORMAT_U8;
+		case PA_SAMPLE_S16LE:
+			return SND_PCM_FORMAT_S16_LE;
+		case PA_SAMPLE_S16BE:
+			return SND_PCM_FORMAT_S16_BE;
+		case PA_SAMPLE_S24LE:
+			return SND_PCM_FORMAT_S24_3LE;
+		case PA_SAMPLE_S24_32LE:
+			return SND_PCM_FORMAT_S24_LE;
+		case PA_SAMPLE_S32LE:
+			return SND_PCM_FORMAT_S32_LE;
+		case PA_SAMPLE_S32BE:
+			return SND_PCM_FORMAT_S32_BE;
+		case PA_SAMPLE_FLOAT32LE:
+			return SND_PCM_FORMAT_FLOAT_LE;
+		case PA_SAMPLE_FLOAT32BE:
+			return SND_PCM_FORMAT_FLOAT_BE;
+		default:
+			return SND_PCM_FORMAT_UNKNOWN;
+	}
+}
+
+static unsigned int playback_chmap_position(pa_channel_position_t p)
+{
+	switch (p)
 	{
-		printf("Inbuffer %zu is too low, skipping decode step\n", inbuffer_length);
+		case PA_CHANNEL_POSITION_MONO:
+			return SND_CHMAP_MONO;
+		case PA_CHANNEL_POSITION_FRONT_LEFT:
+			return SND_CHMAP_FL;
+		case PA_CHANNEL_POSITION_FRONT_RIGHT:
+			return SND_CHMAP_FR;
+		case PA_CHANNEL_POSITION_FRONT_CENTER:
+			return SND_CHMAP_FC;
+		case PA_CHANNEL_POSITION_REAR_LEFT:
+			return SND_CHMAP_RL;
+		case PA_CHANNEL_POSITION_REAR_RIGHT:
+			return SND_CHMAP_RR;
+		case PA_CHANNEL_POSITION_REAR_CENTER:
+			return SND_CHMAP_RC;
+		case PA_CHANNEL_POSITION_LFE:
+			return SND_CHMAP_LFE;
+		case PA_CHANNEL_POSITION_SIDE_LEFT:
+			return SND_CHMAP_SL;
+		case PA_CHANNEL_POSITION_SIDE_RIGHT:
+			return SND_CHMAP_SR;
+		case PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER:
+			return SND_CHMAP_FLC;
+		case PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER:
+			return SND_CHMAP_FRC;
+		default:
+			return SND_CHMAP_UNKNOWN;
 	}
-#endif
+}
 
-	if(state==PCM)
+/* Without PulseAudio to remap, the device is asked to take our channel order.
+ * Most drivers with a fixed order refuse, then it is their default order */
+static void playback_set_chmap(const pa_channel_map *map)
+{
+	snd_pcm_chmap_t *chmap;
+	int i;
+
+	if (map->channels <= 2)
+		return;
+
+	chmap = alloca(sizeof(*chmap) + map->channels * sizeof(chmap->pos[0]));
+	chmap->channels = map->channels;
+	for (i = 0; i < map->channels; i++)
+		chmap->pos[i] = playback_chmap_position(map->map[i]);
+
+	if (snd_pcm_set_chmap(playback, chmap) < 0 && verbose)
+		fprintf(stderr, "ALSA device %s keeps its own channel order\n", playback_device);
+}
+
+static void playback_enable(int enable)
+{
+	int i;
+
+	if (playback_waiting == enable)
+		return;
+
+	for (i = 0; i < playback_nfds; i++)
+		mainloop_api->io_enable(playback_events[i], enable ? poll_to_io_flags(playback_fds[i].events) : PA_IO_EVENT_NULL);
+
+	playback_waiting = enable;
+}
+
+/* Gets the device going again after an underrun or a suspend. Playback
+ * restarts by itself once the buffer is full */
+static int playback_recover(int err)
+{
+	int r;
+
+	if (err == -EPIPE)
 	{
-		if(iec61937_suspect(data, length))
-		{
-			printf("Suspected IEC61937\n");
-			set_state(IEC61937);
-			return;
-		}
+		underruns++;
+		if (verbose)
+			fprintf(stderr, "Stream underrun.\n");
+	}
 
-   		outbuffer = pa_xrealloc(outbuffer, outbuffer_index + outbuffer_length + length);
-   		memcpy((uint8_t*) outbuffer + outbuffer_index + outbuffer_length, data, length);
-   		outbuffer_length += length;
+	if ((r = snd_pcm_recover(playback, err, 1)) < 0)
+	{
+		fprintf(stderr, "ALSA playback failed: %s\n", snd_strerror(r));
+		return r;
 	}
 
-	if(outstream && pa_stream_get_state(outstream) == PA_STREAM_READY)
-		stream_write_callback(outstream, pa_stream_writable_size(outstream), NULL);
+	return 0;
 }
 
-/* This is called whenever new data may is available */
-static void stream_read_callback(pa_stream *s, size_t length, void *userdata)
+/* Plays out the hardware buffer, a few milliseconds at most */
+static void playback_close(void)
 {
-	const void *data;
+	int i;
 
-	assert(s);
-	assert(length > 0);
+	if (!playback)
+		return;
 
-	if (pa_stream_peek(s, &data, &length) < 0)
+	if (snd_pcm_state(playback) == SND_PCM_STATE_RUNNING || snd_pcm_state(playback) == SND_PCM_STATE_PREPARED)
 	{
-		fprintf(stderr, "pa_stream_peek() failed: %s\n", pa_strerror(pa_context_errno(context)));
-		quit(1);
+		snd_pcm_nonblock(playback, 0);
+		snd_pcm_drain(playback);
+	}
+
+	for (i = 0; i < playback_nfds; i++)
+		if (playback_events[i])
+			mainloop_api->io_free(playback_events[i]);
+
+	pa_xfree(playback_events);
+	pa_xfree(playback_fds);
+	playback_events = NULL;
+	playback_fds = NULL;
+	playback_nfds = 0;
+	playback_waiting = 0;
+
+	snd_pcm_close(playback);
+	playback = NULL;
+}
+
+static void playback_finish_drain(void)
+{
+	snd_pcm_nonblock(playback, 0);
+	snd_pcm_drain(playback);
+	playback_close();
+	output_drained();
+}
+
+static void playback_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+{
+	unsigned short revents = 0;
+	int i;
+
+	for (i = 0; i < playback_nfds; i++)
+		playback_fds[i].revents = playback_events[i] == e ? io_flags_to_poll(f) : 0;
+
+	if (snd_pcm_poll_descriptors_revents(playback, playback_fds, playback_nfds, &revents) < 0 || !(revents & (POLLOUT | POLLERR)))
+		return;
+
+	/* A recovery now would move the area the decode thread is writing to.
+	 * The decoder turns the events back on when it asks for room again */
+	if (output_direct_write)
+	{
+		playback_enable(0);
 		return;
 	}
 
-	decode_data(data, length, userdata);
+	output_write_callback(output->writable_size());
 
-	pa_stream_drop(s);
+	/* Nothing left to write, so the events would fire again right away.
+	 * They are turned back on when the decoder asks for room */
+	if (playback && !ringbuffer_length(&outbuffer))
+	{
+		playback_enable(0);
+		if (playback_draining)
+			playback_finish_drain();
+	}
 }
 
-/* New data on STDIN **/
-static void stdin_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+static int playback_open(const pa_sample_spec *spec, const pa_channel_map *map)
 {
-	uint8_t buf[MAX_STDIN_READ];
-	ssize_t r=1;
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_format_t format = playback_format(spec->format);
+	snd_pcm_uframes_t period;
+	unsigned int rate = spec->rate;
+	int r, i;
+
+	if (format == SND_PCM_FORMAT_UNKNOWN)
+	{
+		fprintf(stderr, "ALSA output does not support %s samples\n", pa_sample_format_to_string(spec->format));
+		return -1;
+	}
+
+	if ((r = snd_pcm_open(&playback, playback_device, SND_PCM_STREAM_PLAYBACK, SND_PCM_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Cannot open ALSA device %s: %s\n", playback_device, snd_strerror(r));
+		playback = NULL;
+		return -1;
+	}
+
+	period = pa_usec_to_bytes(playback_period_usec, spec) / pa_frame_size(spec);
+	playback_buffer = pa_usec_to_bytes(playback_buffer_usec, spec) / pa_frame_size(spec);
+
+	snd_pcm_hw_params_alloca(&hwparams);
+	if ((r = snd_pcm_hw_params_any(playback, hwparams)) < 0 ||
+		(r = snd_pcm_hw_params_set_access(playback, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+		(r = snd_pcm_hw_params_set_format(playback, hwparams, format)) < 0 ||
+		(r = snd_pcm_hw_params_set_channels(playback, hwparams, spec->channels)) < 0 ||
+		(r = snd_pcm_hw_params_set_rate_resample(playback, hwparams, 0)) < 0 ||
+		(r = snd_pcm_hw_params_set_rate_near(playback, hwparams, &rate, NULL)) < 0 ||
+		(r = snd_pcm_hw_params_set_period_size_near(playback, hwparams, &period, NULL)) < 0 ||
+		(r = snd_pcm_hw_params_set_buffer_size_near(playback, hwparams, &playback_buffer)) < 0 ||
+		(r = snd_pcm_hw_params(playback, hwparams)) < 0)
+	{
+		fprintf(stderr, "Cannot set up ALSA device %s for %s: %s\n", playback_device, pa_sample_format_to_string(spec->format), snd_strerror(r));
+		return -1;
+	}
+
+	if (rate != spec->rate)
+	{
+		fprintf(stderr, "ALSA device %s cannot play at %u Hz\n", playback_device, spec->rate);
+		return -1;
+	}
+
+	snd_pcm_hw_params_get_period_size(hwparams, &period, NULL);
+	snd_pcm_hw_params_get_buffer_size(hwparams, &playback_buffer);
+
+	/* Wake up every period, start once the buffer is full */
+	snd_pcm_sw_params_alloca(&swparams);
+	if ((r = snd_pcm_sw_params_current(playback, swparams)) < 0 ||
+		(r = snd_pcm_sw_params_set_avail_min(playback, swparams, period)) < 0 ||
+		(r = snd_pcm_sw_params_set_start_threshold(playback, swparams, playback_buffer)) < 0 ||
+		(r = snd_pcm_sw_params(playback, swparams)) < 0)
+	{
+		fprintf(stderr, "Cannot set up ALSA device %s: %s\n", playback_device, snd_strerror(r));
+		return -1;
+	}
+
+	playback_set_chmap(map);
+
+	if ((playback_nfds = snd_pcm_poll_descriptors_count(playback)) <= 0)
+	{
+		fprintf(stderr, "ALSA device %s cannot be polled\n", playback_device);
+		return -1;
+	}
+
+	playback_fds = pa_xmalloc0(playback_nfds * sizeof(*playback_fds));
+	playback_events = pa_xmalloc0(playback_nfds * sizeof(*playback_events));
+	snd_pcm_poll_descriptors(playback, playback_fds, playback_nfds);
+
+	for (i = 0; i < playback_nfds; i++)
+		if (!(playback_events[i] = mainloop_api->io_new(mainloop_api, playback_fds[i].fd, PA_IO_EVENT_NULL, playback_callback, NULL)))
+		{
+			fprintf(stderr, "io_new() failed.\n");
+			return -1;
+		}
+
+	playback_frame_size = pa_frame_size(spec);
+	playback_waiting = 0;
+	playback_draining = 0;
+
+	print_output_spec(spec, map);
+	fprintf(stderr, "Playing to ALSA device %s, period %zu usec, buffer %zu usec\n", playback_device,
+			(size_t)pa_bytes_to_usec(period * playback_frame_size, spec), (size_t)pa_bytes_to_usec(playback_buffer * playback_frame_size, spec));
+
+	return 0;
+}
+
+static int playback_is_open(void)
+{
+	return playback != NULL;
+}
+
+/* Being asked means there is something to write, so this also makes sure
+ * to be woken up when there is room for it */
+static size_t playback_writable_size(void)
+{
+	snd_pcm_sframes_t avail;
+
+	if (!playback)
+		return 0;
+
+	if ((avail = snd_pcm_avail_update(playback)) < 0)
+	{
+		if (playback_recover(avail) < 0 || (avail = snd_pcm_avail_update(playback)) < 0)
+		{
+			quit(1);
+			return 0;
+		}
+	}
+
+	playback_enable(1);
+
+	return (size_t)avail * playback_frame_size;
+}
+
+static int playback_begin_write(void **buf, size_t *l)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t frames = *l / playback_frame_size;
+	int r;
+
+	if ((r = snd_pcm_mmap_begin(playback, &areas, &playback_mmap_offset, &frames)) < 0)
+	{
+		fprintf(stderr, "snd_pcm_mmap_begin() failed: %s\n", snd_strerror(r));
+		return -1;
+	}
+
+	/* Interleaved, so the first channel's area is the whole frame */
+	playback_mmap_buf = (uint8_t *)areas[0].addr + areas[0].first / 8 + playback_mmap_offset * (areas[0].step / 8);
+	*buf = playback_mmap_buf;
+	*l = frames * playback_frame_size;
+	return 0;
+}
+
+static void playback_cancel_write(void)
+{
+	playback_mmap_buf = NULL;
+}
+
+static int playback_commit(snd_pcm_uframes_t offset, snd_pcm_uframes_t frames)
+{
+	snd_pcm_sframes_t r = snd_pcm_mmap_commit(playback, offset, frames);
+
+	if (r < 0 || (snd_pcm_uframes_t)r != frames)
+		return playback_recover(r < 0 ? r : -EPIPE);
+
+	return 0;
+}
+
+/* Data that is not in the hardware buffer yet gets copied there, wrapping
+ * around as needed. It has to fit into writable_size() */
+static int playback_write(const void *data, size_t l)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	int r;
+
+	if (data == playback_mmap_buf)
+	{
+		playback_mmap_buf = NULL;
+		return playback_commit(playback_mmap_offset, l / playback_frame_size);
+	}
+
+	while (l >= playback_frame_size)
+	{
+		frames = l / playback_frame_size;
+		if ((r = snd_pcm_mmap_begin(playback, &areas, &offset, &frames)) < 0)
+		{
+			fprintf(stderr, "snd_pcm_mmap_begin() failed: %s\n", snd_strerror(r));
+			return -1;
+		}
+
+		if (!frames)
+			break;
+
+		memcpy((uint8_t *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8), data, frames * playback_frame_size);
+		if ((r = playback_commit(offset, frames)) < 0)
+			return r;
+
+		data = (const uint8_t *)data + frames * playback_frame_size;
+		l -= frames * playback_frame_size;
+	}
+
+	return 0;
+}
+
+/* Keeps feeding outbuffer to the device from the poll callback, which then
+ * plays the rest out */
+static void playback_drain(void)
+{
+	if (!playback)
+	{
+		output_drained();
+		return;
+	}
+
+	playback_draining = 1;
+	output_write_callback(output->writable_size());
+
+	if (playback && !ringbuffer_length(&outbuffer))
+	{
+		playback_enable(0);
+		playback_finish_drain();
+	}
+}
+
+/* The hardware buffer is only a few milliseconds deep, so its delay is what
+ * drifts first when the DAC clock is not the source's */
+static int playback_latency(pa_usec_t *usec)
+{
+	snd_pcm_sframes_t delay;
+
+	if (!playback || snd_pcm_state(playback) != SND_PCM_STATE_RUNNING || snd_pcm_delay(playback, &delay) < 0)
+		return -1;
+
+	*usec = delay > 0 ? pa_bytes_to_usec((uint64_t)delay * playback_frame_size, &out_sample_spec) : 0;
+	return 0;
+}
+
+static void playback_free(void)
+{
+	playback_close();
+}
+
+static const struct output_backend alsa_output =
+{
+	.open = playback_open,
+	.close = playback_close,
+	.is_open = playback_is_open,
+	.writable_size = playback_writable_size,
+	.begin_write = playback_begin_write,
+	.cancel_write = playback_cancel_write,
+	.write = playback_write,
+	.drain = playback_drain,
+	.free = playback_free,
+	.latency = playback_latency,
+};
+
+/* Picks the backend for the output device argument. Anything that is not
+ * one of the names below is a PulseAudio sink */
+static const struct output_backend *output_select(const char *device)
+{
+	if (!device)
+		return &pulse_output;
+
+	if (!strcmp(device, "null:"))
+		return &null_output;
+
+	if (!strcmp(device, "null:fast"))
+	{
+		null_fast = 1;
+		return &null_output;
+	}
+
+	if (!strcmp(device, "-"))
+	{
+		file_path = device;
+		return &file_output;
+	}
+
+	if (!strncmp(device, "alsa:", 5))
+	{
+		playback_device = device + 5;
+		return &alsa_output;
+	}
+
+	if (!strncmp(device, "file:", 5) || !strncmp(device, "wav:", 4))
+	{
+		file_path = strchr(device, ':') + 1;
+		file_wav = device[0] == 'w' || (strlen(file_path) > 4 && !strcasecmp(file_path + strlen(file_path) - 4, ".wav"));
+		return &file_output;
+	}
+
+	return &pulse_output;
+}
+
+/* Maps FFMpeg sample format to PA sample format */
+enum pa_sample_format map_sample_format(enum AVSampleFormat format)
+{
+	const int isbe = (*(uint16_t *)"\0\xff" < 0x100) ? 1 : 0;
+	switch(av_get_packed_sample_fmt(format))
+	{
+		case AV_SAMPLE_FMT_U8:
+			return PA_SAMPLE_U8;
+		case AV_SAMPLE_FMT_S16:
+			return PA_SAMPLE_S16LE + isbe;
+		case AV_SAMPLE_FMT_S32:
+			return PA_SAMPLE_S32LE + isbe;
+		case AV_SAMPLE_FMT_FLT:
+			return PA_SAMPLE_FLOAT32LE + isbe;
+		case AV_SAMPLE_FMT_DBL:
+			fprintf(stderr, "PulseAudio does not support double float sample formats\n");
+		default:
+			fprintf(stderr, "Unexpected sample format %s\n", av_get_sample_fmt_name(format));
+	}
+	return PA_SAMPLE_INVALID;
+}
+
+void map_channel_layout(pa_channel_map* channel_map, AVChannelLayout* channel_layout)
+{
+	pa_channel_map_init(channel_map);
+	channel_map->channels = channel_layout->nb_channels;
+
+	int i;
+	for(i = 0; i < channel_map->channels; i++)
+	{
+		switch(av_channel_layout_channel_from_index(channel_layout, i))
+		{
+			case AV_CHAN_FRONT_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT;
+				break;
+			case AV_CHAN_FRONT_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT;
+				break;
+			case AV_CHAN_FRONT_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_CENTER;
+				break;
+			case AV_CHAN_LOW_FREQUENCY:
+				channel_map->map[i] = PA_CHANNEL_POSITION_LFE;
+				break;
+			case AV_CHAN_BACK_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_LEFT;
+				break;
+			case AV_CHAN_BACK_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_RIGHT;
+				break;
+			case AV_CHAN_FRONT_LEFT_OF_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER;
+				break;
+			case AV_CHAN_FRONT_RIGHT_OF_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER;
+				break;
+			case AV_CHAN_BACK_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_REAR_CENTER;
+				break;
+			case AV_CHAN_SIDE_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
+				break;
+			case AV_CHAN_SIDE_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
+				break;
+			case AV_CHAN_TOP_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_CENTER;
+				break;
+			case AV_CHAN_TOP_FRONT_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_LEFT;
+				break;
+			case AV_CHAN_TOP_FRONT_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_CENTER;
+				break;
+			case AV_CHAN_TOP_FRONT_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_FRONT_RIGHT;
+				break;
+			case AV_CHAN_TOP_BACK_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_LEFT;
+				break;
+			case AV_CHAN_TOP_BACK_CENTER:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_CENTER;
+				break;
+			case AV_CHAN_TOP_BACK_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_TOP_REAR_RIGHT;
+				break;
+			case AV_CHAN_STEREO_LEFT: //Stereo downmix
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_LEFT;
+				break;
+			case AV_CHAN_STEREO_RIGHT: //See AV_CHAN_STEREO_LEFT
+				channel_map->map[i] = PA_CHANNEL_POSITION_FRONT_RIGHT;
+				break;
+			case AV_CHAN_WIDE_LEFT: // PA does not have wide speakers, so map them to side instead. If both of your setup and source have both wide and side speakers, you may want to change this to PA_CHANNEL_POSITION_AUX*. And if this is the case, please also send me a postcard.
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
+				break;
+			case AV_CHAN_WIDE_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
+				break;
+			case AV_CHAN_SURROUND_DIRECT_LEFT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_LEFT;
+				break;
+			case AV_CHAN_SURROUND_DIRECT_RIGHT:
+				channel_map->map[i] = PA_CHANNEL_POSITION_SIDE_RIGHT;
+				break;
+			case AV_CHAN_LOW_FREQUENCY_2:
+				channel_map->map[i] = PA_CHANNEL_POSITION_LFE;
+				break;
+
+			default:
+				char channel_name[256];
+				char channel_layout_name[256];
+				if (av_channel_name(channel_name, sizeof(channel_name), av_channel_layout_channel_from_index(channel_layout, i)) >= sizeof(channel_name))
+					sprintf(channel_name, "Unknown");
+				if (av_channel_layout_describe(channel_layout, channel_layout_name, sizeof(channel_layout_name)) >= sizeof(channel_layout_name))
+					sprintf(channel_layout_name, "Unknown");
+				fprintf(stderr, "Unexpected channel %d position %s for layout %s\n", i, channel_name, channel_layout_name);
+				channel_map->map[i] = PA_CHANNEL_POSITION_INVALID;
+		}
+	}
+}
+
+/* FFmpeg channel mask of a PulseAudio position, the reverse of map_channel_layout() */
+static uint64_t pinned_channel_mask(pa_channel_position_t position)
+{
+	switch(position)
+	{
+		case PA_CHANNEL_POSITION_MONO:
+		case PA_CHANNEL_POSITION_FRONT_CENTER:
+			return AV_CH_FRONT_CENTER;
+		case PA_CHANNEL_POSITION_FRONT_LEFT:
+			return AV_CH_FRONT_LEFT;
+		case PA_CHANNEL_POSITION_FRONT_RIGHT:
+			return AV_CH_FRONT_RIGHT;
+		case PA_CHANNEL_POSITION_LFE:
+			return AV_CH_LOW_FREQUENCY;
+		case PA_CHANNEL_POSITION_REAR_LEFT:
+			return AV_CH_BACK_LEFT;
+		case PA_CHANNEL_POSITION_REAR_RIGHT:
+			return AV_CH_BACK_RIGHT;
+		case PA_CHANNEL_POSITION_FRONT_LEFT_OF_CENTER:
+			return AV_CH_FRONT_LEFT_OF_CENTER;
+		case PA_CHANNEL_POSITION_FRONT_RIGHT_OF_CENTER:
+			return AV_CH_FRONT_RIGHT_OF_CENTER;
+		case PA_CHANNEL_POSITION_REAR_CENTER:
+			return AV_CH_BACK_CENTER;
+		case PA_CHANNEL_POSITION_SIDE_LEFT:
+			return AV_CH_SIDE_LEFT;
+		case PA_CHANNEL_POSITION_SIDE_RIGHT:
+			return AV_CH_SIDE_RIGHT;
+		case PA_CHANNEL_POSITION_TOP_CENTER:
+			return AV_CH_TOP_CENTER;
+		case PA_CHANNEL_POSITION_TOP_FRONT_LEFT:
+			return AV_CH_TOP_FRONT_LEFT;
+		case PA_CHANNEL_POSITION_TOP_FRONT_CENTER:
+			return AV_CH_TOP_FRONT_CENTER;
+		case PA_CHANNEL_POSITION_TOP_FRONT_RIGHT:
+			return AV_CH_TOP_FRONT_RIGHT;
+		case PA_CHANNEL_POSITION_TOP_REAR_LEFT:
+			return AV_CH_TOP_BACK_LEFT;
+		case PA_CHANNEL_POSITION_TOP_REAR_CENTER:
+			return AV_CH_TOP_BACK_CENTER;
+		case PA_CHANNEL_POSITION_TOP_REAR_RIGHT:
+			return AV_CH_TOP_BACK_RIGHT;
+		default:
+			return 0;
+	}
+}
+
+/* Parses --pin=[MAP][@RATE] into the float32 format every source is converted
+ * to. The channels end up in FFmpeg's native order, which is what swr produces */
+static int pin_parse(const char *arg)
+{
+	char name[PA_CHANNEL_MAP_SNPRINT_MAX] = "surround-71";
+	const char *rate = arg ? strchr(arg, '@') : NULL;
+	pa_channel_map map;
+	uint64_t mask = 0, m;
+	int i;
+
+	pinned_spec.format = map_sample_format(AV_SAMPLE_FMT_FLT);
+	pinned_spec.rate = 48000;
+
+	if(arg)
+	{
+		size_t l = rate ? (size_t)(rate - arg) : strlen(arg);
+		if(l >= sizeof(name))
+			goto fail;
+		if(l)
+		{
+			memcpy(name, arg, l);
+			name[l] = 0;
+		}
+		if(rate && !(pinned_spec.rate = strtoul(rate + 1, NULL, 10)))
+			goto fail;
+	}
+
+	if(!pa_channel_map_parse(&map, name))
+		goto fail;
+
+	for(i = 0; i < map.channels; i++)
+	{
+		if(!(m = pinned_channel_mask(map.map[i])) || (mask & m))
+			goto fail;
+		mask |= m;
+	}
+
+	av_channel_layout_uninit(&pinned_layout);
+	if(av_channel_layout_from_mask(&pinned_layout, mask) < 0)
+		goto fail;
+
+	pinned_spec.channels = pinned_layout.nb_channels;
+	if(!pa_sample_spec_valid(&pinned_spec))
+		goto fail;
+
+	pinned = 1;
+	out_bytes_per_sample = pa_frame_size(&pinned_spec);
+	return 0;
+
+fail:
+	fprintf(stderr, "Invalid output format to pin: %s\n", arg);
+	return -1;
+}
+
+void open_output_stream(void)
+{
+	pa_channel_map out_channel_map;
+
+	assert(!output_open());
+
+	if(pinned)
+	{
+		/* Every source is converted to this, the stream outlives state changes */
+		out_sample_spec = pinned_spec;
+		map_channel_layout(&out_channel_map, &pinned_layout);
+		tlength = pa_usec_to_bytes(PINNED_TLENGTH, &out_sample_spec);
+	}
+	else if(state == IEC61937)
+	{
+		out_sample_spec.format = map_sample_format(swroutformat);
+		out_sample_spec.rate = decoded_format.sample_rate;
+		map_channel_layout(&out_channel_map, &decoded_format.ch_layout);
+		out_sample_spec.channels = out_channel_map.channels;
+		tlength = block_size / 4 * out_bytes_per_sample * 2;
+	}
+	else
+	{
+		out_sample_spec.format = in_sample_spec.format;
+		out_sample_spec.rate = in_sample_spec.rate;
+		out_sample_spec.channels = in_sample_spec.channels;
+		if (instream)
+		{
+			memcpy(&out_channel_map, pa_stream_get_channel_map(instream), sizeof(pa_channel_map));
+			tlength = pa_stream_get_buffer_attr(instream)->fragsize;
+		}
+		else
+		{
+			pa_channel_map_init(&out_channel_map);
+			out_channel_map.channels = 2;
+			out_channel_map.map[0] = PA_CHANNEL_POSITION_FRONT_LEFT;
+			out_channel_map.map[1] = PA_CHANNEL_POSITION_FRONT_RIGHT;
+			tlength = 16384;
+		}
+	}
+
+	/* Room for the flush threshold in output_write_callback() plus some decoded frames on top */
+	ringbuffer_reserve(&outbuffer, (size_t)tlength * 16);
+
+	/* The controller starts over, the drift estimate is kept */
+	latency_samples = 0;
+	corrected_rate = out_sample_spec.rate;
+
+	if (output->open(&out_sample_spec, &out_channel_map) < 0)
+		quit(1);
+}
+
+void print_averror(const char *str, int err)
+{
+	char errbuf[128];
+	const char *errbuf_ptr = errbuf;
+
+	if (av_strerror(err, errbuf, sizeof(errbuf)) < 0)
+		errbuf_ptr = strerror(AVUNERROR(err));
+
+	fprintf(stderr, "%s: %s\n", str, errbuf_ptr);
+}
+
+/* Wakes the decode thread up once fragsize bytes are captured */
+static void capture_set_fragsize(size_t fragsize)
+{
+	snd_pcm_sw_params_t *swparams;
+	snd_pcm_uframes_t frames = fragsize / pa_frame_size(&in_sample_spec);
+	int r;
+
+	if (frames < capture_period)
+		frames = capture_period;
+	if (frames > capture_buffer / 2)
+		frames = capture_buffer / 2;
+
+	capture_fragsize = frames * pa_frame_size(&in_sample_spec);
+
+	snd_pcm_sw_params_alloca(&swparams);
+	if ((r = snd_pcm_sw_params_current(capture, swparams)) < 0 ||
+		(r = snd_pcm_sw_params_set_avail_min(capture, swparams, frames)) < 0 ||
+		(r = snd_pcm_sw_params(capture, swparams)) < 0)
+		fprintf(stderr, "Cannot set the ALSA capture wakeup: %s\n", snd_strerror(r));
+}
+
+void set_instream_fragsize(uint32_t fragsize)
+{
+	fprintf(stderr, "Setting target input latency to %zu usec (%u bytes)\n", (size_t)pa_bytes_to_usec(fragsize, &in_sample_spec), fragsize);
+	if(instream)
+	{
+		pa_buffer_attr buffer_attr;
+		memcpy(&buffer_attr, pa_stream_get_buffer_attr(instream), sizeof(pa_buffer_attr));
+		buffer_attr.fragsize = fragsize;
+		pa_operation_unref(pa_stream_set_buffer_attr(instream, &buffer_attr, stream_set_buffer_attr_callback, NULL));
+	}
+	else if(capture)
+		capture_set_fragsize(fragsize);
+	else
+	{
+		stdin_fragsize = fragsize == (uint32_t) -1 ? MAX_STDIN_READ : fragsize;
+		if(stdin_fragsize > MAX_STDIN_READ)
+			stdin_fragsize = MAX_STDIN_READ;
+	}
+}
+
+/* Output sample format for a decoded format, PulseAudio has no doubles */
+static enum AVSampleFormat converter_output_format(enum AVSampleFormat sample_fmt)
+{
+	enum AVSampleFormat format = av_get_packed_sample_fmt(sample_fmt);
+
+	if(pinned)
+		return AV_SAMPLE_FMT_FLT;
+
+	return format == AV_SAMPLE_FMT_DBL ? AV_SAMPLE_FMT_FLT : format;
+}
+
+/* Sets swrcontext up to convert the given decoded format to packed samples,
+ * remixed and resampled to the pinned format if there is one */
+static int setup_converter(int sample_rate, const AVChannelLayout *ch_layout, enum AVSampleFormat sample_fmt)
+{
+	const AVChannelLayout *out_layout = pinned ? &pinned_layout : ch_layout;
+	int r;
+
+	swroutformat = converter_output_format(sample_fmt);
+	if ((r = swr_alloc_set_opts2(&swrcontext,
+									out_layout,
+									swroutformat,
+									pinned ? (int)pinned_spec.rate : sample_rate,
+									ch_layout,
+									sample_fmt,
+									sample_rate,
+									0, NULL)) < 0 ||
+		/* Resampling is enabled from the start so drift compensation can
+		 * be switched on later without a reinit */
+		(r = av_opt_set_int(swrcontext, "flags", SWR_FLAG_RESAMPLE, 0)) < 0 ||
+		(r = swr_init(swrcontext)) < 0)
+	{
+		print_averror("swr_alloc_set_opts2", r);
+		swr_free(&swrcontext);
+		return r;
+	}
+
+	decoded_format.sample_rate = sample_rate;
+	av_channel_layout_uninit(&decoded_format.ch_layout);
+	av_channel_layout_copy(&decoded_format.ch_layout, ch_layout);
+	decoded_format.sample_fmt = sample_fmt;
+	compensation_applied = COMPENSATION_UNSET;
+
+	out_bytes_per_sample = av_get_bytes_per_sample(swroutformat) * (size_t)out_layout->nb_channels;
+
+	return 0;
+}
+
+static int decoded_format_matches(const struct decoded_format *f, const AVFrame *frame)
+{
+	return f->sample_rate == frame->sample_rate && f->sample_fmt == frame->format && !av_channel_layout_compare(&f->ch_layout, &frame->ch_layout);
+}
+
+static void decoder_cache_free_entry(struct decoder_cache_entry *e)
+{
+	avcodec_free_context(&e->codec);
+	swr_free(&e->swr);
+	av_channel_layout_uninit(&e->format.ch_layout);
+	memset(e, 0, sizeof(*e));
+}
+
+/* Keeps the current decoder and converter for reuse after a drop-out instead
+ * of freeing them. Evicts the least recently used entry if the cache is full */
+static void decoder_cache_put(void)
+{
+	static unsigned long clock = 0;
+	struct decoder_cache_entry *e = &decoder_cache[0];
+	int i;
+
+	for(i = 0; i < DECODER_CACHE_SIZE; i++)
+	{
+		if(!decoder_cache[i].codec)
+		{
+			e = &decoder_cache[i];
+			break;
+		}
+		if(decoder_cache[i].last_used < e->last_used)
+			e = &decoder_cache[i];
+	}
+
+	if(e->codec)
+		decoder_cache_free_entry(e);
+
+	/* Lets go of the packets in stream_arena, the next stream reuses it */
+	avcodec_flush_buffers(avcodeccontext);
+
+	e->codec = avcodeccontext;
+	e->swr = swrcontext;
+	e->format = decoded_format;
+	e->last_used = ++clock;
+
+	avcodeccontext = NULL;
+	swrcontext = NULL;
+	memset(&decoded_format, 0, sizeof(decoded_format));
+}
+
+/* Resumes the most recently used cached decoder for the codec that was
+ * putting out the format, if any. Returns 1 if one was found */
+static int decoder_cache_take(enum AVCodecID codec_id, const struct decoded_format *f)
+{
+	struct decoder_cache_entry *e = NULL;
+	int i;
+
+	for(i = 0; i < DECODER_CACHE_SIZE; i++)
+		if(decoder_cache[i].codec && decoder_cache[i].codec->codec_id == codec_id
+				&& decoder_cache[i].format.sample_rate == f->sample_rate
+				&& decoder_cache[i].format.sample_fmt == f->sample_fmt
+				&& !av_channel_layout_compare(&decoder_cache[i].format.ch_layout, &f->ch_layout)
+				&& (!e || decoder_cache[i].last_used > e->last_used))
+			e = &decoder_cache[i];
+
+	if(!e)
+		return 0;
+
+	avcodeccontext = e->codec;
+	swrcontext = e->swr;
+	decoded_format = e->format;
+	memset(e, 0, sizeof(*e));
+
+	avcodec_flush_buffers(avcodeccontext);
+	swr_init(swrcontext);
+	compensation_applied = COMPENSATION_UNSET;
+
+	swroutformat = converter_output_format(decoded_format.sample_fmt);
+	out_bytes_per_sample = av_get_bytes_per_sample(swroutformat) * (size_t)(pinned ? pinned_layout.nb_channels : decoded_format.ch_layout.nb_channels);
+
+	if(verbose)
+		fprintf(stderr, "Resuming cached %s decoder\n", avcodec_get_name(codec_id));
+
+	return 1;
+}
+
+static void decoder_cache_free(void)
+{
+	int i;
+
+	for(i = 0; i < DECODER_CACHE_SIZE; i++)
+		if(decoder_cache[i].codec)
+			decoder_cache_free_entry(&decoder_cache[i]);
+}
+
+/* Runs every LATENCY_CONTROL_INTERVAL on the mainloop thread. Measures how
+ * much audio is queued for the sink and steers the output rate to hold it at
+ * the target with a PI controller, whose integral term converges to the clock
+ * drift between the S/PDIF source and the sink. Positive ppm means the source
+ * is faster and the output has to be played faster to keep up. */
+static void latency_control_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+	struct timeval next;
+	pa_usec_t latency;
+
+	pa_usec_t late = pa_timeval_age(tv);
+	if (late > timer_late_max)
+		timer_late_max = late;
+
+	a->time_restart(e, pa_timeval_add(pa_gettimeofday(&next), LATENCY_CONTROL_INTERVAL));
+
+	/* The output is not asked while the decode thread writes to it directly */
+	if(!latency_controlled() || !output->latency || state == NOSIGNAL || output_direct_write || output->latency(&latency) < 0)
+		return;
+
+	double l = (double)latency + (double)pa_bytes_to_usec(ringbuffer_length(&outbuffer), &out_sample_spec);
+
+	if(!latency_samples++)
+		measured_latency = l;
+	else
+		measured_latency += (l - measured_latency) / 4;
+
+	if(latency_samples <= LATENCY_CONTROL_SETTLE)
+		return;
+
+	if(latency_samples == LATENCY_CONTROL_SETTLE + 1)
+	{
+		locked_latency = target_latency ? target_latency : (pa_usec_t)measured_latency;
+		if(verbose)
+			fprintf(stderr, "Holding output latency at %zu usec\n", (size_t)locked_latency);
+	}
+
+	/* usec of error per second is ppm, correct it within 20 s */
+	double error = measured_latency - (double)locked_latency;
+	drift_ppm += error / 1000;
+	if(drift_ppm > LATENCY_CONTROL_MAX_PPM)
+		drift_ppm = LATENCY_CONTROL_MAX_PPM;
+	else if(drift_ppm < -LATENCY_CONTROL_MAX_PPM)
+		drift_ppm = -LATENCY_CONTROL_MAX_PPM;
+
+	correction_ppm = drift_ppm + error / 20;
+	if(correction_ppm > 2*LATENCY_CONTROL_MAX_PPM)
+		correction_ppm = 2*LATENCY_CONTROL_MAX_PPM;
+	else if(correction_ppm < -2*LATENCY_CONTROL_MAX_PPM)
+		correction_ppm = -2*LATENCY_CONTROL_MAX_PPM;
+
+#ifdef DEBUG_LATENCY
+	fprintf(stderr, "Latency %.0f usec, target %zu usec, drift %.1f ppm, correction %.1f ppm\n", measured_latency, (size_t)locked_latency, drift_ppm, correction_ppm);
+#endif
+
+	if(state == IEC61937 || pcm_converted())
+	{
+		/* Applied by the decode thread, the converters belong to it */
+		__atomic_store_n(&compensation_ppm, (int32_t)lrint(correction_ppm), __ATOMIC_RELAXED);
+		uint32_t tick = compensation_tick + 1;
+		__atomic_store_n(&compensation_tick, tick == COMPENSATION_UNSET ? tick + 1 : tick, __ATOMIC_RELEASE);
+	}
+	else
+	{
+		/* PCM is not converted, let the output resample it */
+		uint32_t rate = (uint32_t)lrint(in_sample_spec.rate * (1 + correction_ppm / 1e6));
+		if(rate != corrected_rate && output->update_rate(rate) >= 0)
+			corrected_rate = rate;
+	}
+}
+
+/* Passes the latency controller's correction on to a converter. Called on the
+ * decode thread. Fewer samples are produced when the output must run faster.
+ * swr spreads it over ten control intervals, which keeps a resolution of a
+ * few ppm, and every tick restarts it before it runs out */
+static void apply_compensation(SwrContext *swr)
+{
+	uint32_t tick = __atomic_load_n(&compensation_tick, __ATOMIC_ACQUIRE);
+
+	if(tick == compensation_applied)
+		return;
+
+	int32_t ppm = __atomic_load_n(&compensation_ppm, __ATOMIC_RELAXED);
+	int distance = out_sample_spec.rate * (LATENCY_CONTROL_INTERVAL / 100000);
+	int r = swr_set_compensation(swr, -(int)((int64_t)ppm * distance / 1000000), distance);
+	if(r < 0)
+		print_averror("swr_set_compensation", r);
+
+	compensation_applied = tick;
+}
+
+/* FFmpeg sample format of PCM input, AV_SAMPLE_FMT_NONE if swr cannot take it */
+static enum AVSampleFormat pcm_input_format(pa_sample_format_t format)
+{
+	switch(format)
+	{
+		case PA_SAMPLE_U8:
+			return AV_SAMPLE_FMT_U8;
+		case PA_SAMPLE_S16NE:
+			return AV_SAMPLE_FMT_S16;
+		case PA_SAMPLE_S32NE:
+			return AV_SAMPLE_FMT_S32;
+		case PA_SAMPLE_FLOAT32NE:
+			return AV_SAMPLE_FMT_FLT;
+		default:
+			return AV_SAMPLE_FMT_NONE;
+	}
+}
+
+/* Channel layout of PCM input in FFmpeg's native order, and the input channel
+ * each of its channels comes from. Without a record stream map, or with one
+ * FFmpeg cannot express, it is the default layout for the channel count */
+static void pcm_input_layout(const pa_channel_map *map, AVChannelLayout *layout, int *mapping)
+{
+	uint64_t mask = 0, m = 0;
+	int i;
+
+	for(i = 0; i < map->channels && (m = pinned_channel_mask(map->map[i])) && !(mask & m); i++)
+		mask |= m;
+
+	av_channel_layout_uninit(layout);
+	if(i < map->channels || map->channels != in_sample_spec.channels || av_channel_layout_from_mask(layout, mask) < 0)
+	{
+		av_channel_layout_default(layout, in_sample_spec.channels);
+		for(i = 0; i < in_sample_spec.channels; i++)
+			mapping[i] = i;
+		return;
+	}
+
+	for(i = 0; i < map->channels; i++)
+		mapping[av_channel_layout_index_from_channel(layout, __builtin_ctzll(pinned_channel_mask(map->map[i])))] = i;
+}
+
+/* Sets pcm_swrcontext up for the current input format, if it is not yet */
+static int pcm_converter_setup(void)
+{
+	pa_channel_map map;
+	AVChannelLayout layout = {0};
+	int mapping[PA_CHANNELS_MAX], r;
+
+	if(instream)
+		map = *pa_stream_get_channel_map(instream);
+	else
+		pa_channel_map_init_auto(&map, in_sample_spec.channels, PA_CHANNEL_MAP_DEFAULT);
+
+	if(!pinned)
+		out_bytes_per_sample = pa_frame_size(&in_sample_spec);
+
+	if(pcm_swrcontext && pa_sample_spec_equal(&pcm_converted_spec, &in_sample_spec) && pa_channel_map_equal(&pcm_converted_map, &map))
+		return 0;
+
+	enum AVSampleFormat format = pcm_input_format(in_sample_spec.format);
+	if(format == AV_SAMPLE_FMT_NONE)
+	{
+		fprintf(stderr, "Cannot convert %s samples\n", pa_sample_format_to_string(in_sample_spec.format));
+		return -1;
+	}
+
+	/* Unpinned, only the rate is corrected and the channels stay as they are */
+	if(pinned)
+		pcm_input_layout(&map, &layout, mapping);
+	else
+	{
+		av_channel_layout_default(&layout, in_sample_spec.channels);
+		for(r = 0; r < in_sample_spec.channels; r++)
+			mapping[r] = r;
+	}
+
+	swr_free(&pcm_swrcontext);
+	if ((r = swr_alloc_set_opts2(&pcm_swrcontext,
+									pinned ? &pinned_layout : &layout,
+									pinned ? AV_SAMPLE_FMT_FLT : format,
+									pinned ? pinned_spec.rate : in_sample_spec.rate,
+									&layout,
+									format,
+									in_sample_spec.rate,
+									0, NULL)) < 0 ||
+		(r = av_opt_set_int(pcm_swrcontext, "flags", SWR_FLAG_RESAMPLE, 0)) < 0 ||
+		(r = swr_set_channel_mapping(pcm_swrcontext, mapping)) < 0 ||
+		(r = swr_init(pcm_swrcontext)) < 0)
+	{
+		print_averror("swr_alloc_set_opts2", r);
+		swr_free(&pcm_swrcontext);
+		av_channel_layout_uninit(&layout);
+		return -1;
+	}
+
+	av_channel_layout_uninit(&layout);
+	pcm_converted_spec = in_sample_spec;
+	pcm_converted_map = map;
+	compensation_applied = COMPENSATION_UNSET;
+	return 0;
+}
+
+/* Converts PCM input to the pinned format, or to its own with the drift
+ * correction applied, straight into the stream's buffer when nothing is
+ * pending. With no data, what the converter still holds is flushed out.
+ * Called with the mainloop lock held, which is let go while converting new data */
+static void pcm_write_converted(const void *data, size_t length)
+{
+	const uint8_t *in = data;
+	int samples = length / pa_frame_size(&in_sample_spec), r;
+	uint8_t *outptr;
+	void *buf;
+	size_t l;
+
+	if(data ? pcm_converter_setup() < 0 : !pcm_swrcontext)
+		return;
+
+	if(data)
+		apply_compensation(pcm_swrcontext);
+
+	int outsamples = swr_get_out_samples(pcm_swrcontext, samples);
+	if(outsamples <= 0)
+		return;
+
+	/* The lock is let go while converting new data. The stream's buffer stays
+	 * ours, the mainloop thread only writes out of a non-empty outbuffer and
+	 * does not touch the output while output_direct_write is set */
+	if (output_open() && (l = stream_begin_write(&buf, (size_t)outsamples * out_bytes_per_sample, (size_t)-1)))
+	{
+		outptr = buf;
+		if (data)
+		{
+			output_direct_write = 1;
+			decoder_unlock();
+		}
+		r = swr_convert(pcm_swrcontext, &outptr, l / out_bytes_per_sample, data ? &in : NULL, samples);
+		if (data)
+		{
+			decoder_lock();
+			output_direct_write = 0;
+		}
+		stream_commit_write(buf, r < 0 ? 0 : (size_t)r * out_bytes_per_sample);
+	}
+	else
+	{
+		ringbuffer_reserve(&outbuffer, (size_t)outsamples * out_bytes_per_sample);
+		outptr = ringbuffer_write_ptr(&outbuffer);
+		if (data)
+			decoder_unlock();
+		r = swr_convert(pcm_swrcontext, &outptr, outsamples, data ? &in : NULL, samples);
+		if (data)
+			decoder_lock();
+		if (r >= 0)
+			ringbuffer_commit(&outbuffer, (size_t)r * out_bytes_per_sample);
+	}
+
+	if (r < 0)
+		print_averror("swr_convert", r);
+}
+
+/* Plays out what the PCM converter holds and starts it over, so nothing of
+ * one PCM stretch comes out at the start of the next */
+static void pcm_converter_reset(void)
+{
+	if(!pcm_swrcontext)
+		return;
+
+	pcm_write_converted(NULL, 0);
+	swr_init(pcm_swrcontext);
+}
+
+/* Writes out what the stream can take and drains it. The rest of outbuffer is dropped */
+static void close_output_stream(void)
+{
+	alloc_steady(0);
+
+	/* A pinned stream keeps playing what is queued until quitting */
+	if (pinned && !quitting && output_open())
+		return;
+
+	if (output_open())
+	{
+		output_write_callback(output->writable_size());
+		output->close();
+		out_sample_spec = in_sample_spec;
+		if (verbose)
+			fprintf(stderr, "Closed output stream\n");
+	}
+
+	ringbuffer_clear(&outbuffer);
+}
+
+#define PACKET_SLOTS_MAX 8
+
+/* Packet buffers in stream_arena. A packet with a buffer is only referenced
+ * by avcodec_send_packet(), not copied into a new allocation. A slot is free
+ * again once the decoder has let go of it */
+static AVBufferRef *packet_slots[PACKET_SLOTS_MAX] = {0};
+static int packet_slot_count = 0, packet_slot_next = 0;
+
+/* The memory belongs to the arena */
+static void packet_slot_release(void *opaque, uint8_t *data)
+{
+}
+
+static void packet_slots_free(void)
+{
+	int i;
+
+	for(i = 0; i < packet_slot_count; i++)
+		av_buffer_unref(&packet_slots[i]);
+	packet_slot_count = 0;
+}
+
+/* Sets the arena up for the decoder just opened or resumed: a slot for every
+ * burst its frame threads can hold on to and the one being sent. Without
+ * slots, packets are copied by FFmpeg as before */
+static void packet_slots_setup(void)
+{
+	int count = (avcodeccontext->active_thread_type & FF_THREAD_FRAME ? avcodeccontext->thread_count : 1) + 1;
+	size_t size = block_size + AV_INPUT_BUFFER_PADDING_SIZE;
+	int i;
+
+	/* A flushed or freed decoder holds no packets, the old slots are unused */
+	packet_slots_free();
+
+	if(count > PACKET_SLOTS_MAX)
+		count = PACKET_SLOTS_MAX;
+
+	arena_reset(&stream_arena, count * (size + 64));
+
+	for(i = 0; i < count; i++)
+	{
+		uint8_t *data = arena_alloc(&stream_arena, size);
+		if(!data || !(packet_slots[i] = av_buffer_create(data, size, packet_slot_release, NULL, 0)))
+			break;
+	}
+
+	packet_slot_count = i;
+	packet_slot_next = 0;
+}
+
+/* Moves the burst in pkt into a free slot. Returns 0 and leaves pkt alone if
+ * there is none */
+static int packet_slot_fill(AVPacket *pkt)
+{
+	int i;
+
+	if((size_t)pkt->size > block_size)
+		return 0;
+
+	for(i = 0; i < packet_slot_count; i++)
+	{
+		AVBufferRef *slot = packet_slots[(packet_slot_next + i) % packet_slot_count];
+
+		if(av_buffer_get_ref_count(slot) != 1)
+			continue;
+
+		memcpy(slot->data, pkt->data, pkt->size);
+		memset(slot->data + pkt->size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+		pkt->data = slot->data;
+		pkt->buf = slot;
+		packet_slot_next = (packet_slot_next + i + 1) % packet_slot_count;
+		return 1;
+	}
+
+	return 0;
+}
+
+void set_state(enum state newstate)
+{
+	enum state oldstate = state;
+
+	if(oldstate == newstate)
+		return;
+
+	state_transitions++;
+
+	close_output_stream();
+
+	switch(oldstate)
+	{
+		case NOSIGNAL:
+			break;
+		case PCM:
+			pcm_converter_reset();
+			break;
+		case IEC61937:
+			if(avcodeccontext)
+			{
+				if(swrcontext)
+					decoder_cache_put();
+				else
+					avcodec_free_context(&avcodeccontext);
+				packet_slots_free();
+				if(!pinned)
+					out_bytes_per_sample = 4;
+				block_size = 0;
+			}
+			decoder_cache_pending = 0;
+			iec61937_announced = 0;
+			iec61937_since_burst = 0;
+			iec61937_burst_distance = 0;
+			passthrough_codec = AV_CODEC_ID_NONE;
+			error_rate = 0;
+			compensation_applied = COMPENSATION_UNSET;
+
+			if(newstate == PCM && pcm_converted() && ringbuffer_length(&inbuffer))
+				pcm_write_converted(ringbuffer_read_ptr(&inbuffer), ringbuffer_length(&inbuffer));
+			else if(newstate == PCM)
+				ringbuffer_write(&outbuffer, ringbuffer_read_ptr(&inbuffer), ringbuffer_length(&inbuffer));
+
+			ringbuffer_clear(&inbuffer);
+			memset(&tracker, 0, sizeof(tracker));
+			break;
+	}
+
+	state = newstate;
+
+	switch(newstate)
+	{
+		case NOSIGNAL:
+			set_instream_fragsize(SILENCE_CHECK_SIZE);
+			break;
+		case PCM:
+			fprintf(stderr, "Playing PCM\n");
+			if(!output_open())
+				open_output_stream();
+			break;
+		case IEC61937:
+			break;
+	}
+}
+
+#define SPDIF_MAX_OFFSET 16384*10
+
+/* IEC61937 Pa/Pb preamble (0xF872 0x4E1F as little-endian words) */
+static const uint8_t iec61937_sync[4] = {0x72, 0xF8, 0x1F, 0x4E};
+
+/* Returns the offset of the first IEC61937 sync word in data, or length if
+ * there is none. The vector kernels compare 16 candidate offsets per step */
+size_t iec61937_find_sync(const uint8_t *data, size_t length)
+{
+	size_t i = 0;
+	const uint8_t *p;
+
+#if defined(__SSE2__)
+	const __m128i b0 = _mm_set1_epi8(iec61937_sync[0]), b1 = _mm_set1_epi8(iec61937_sync[1]),
+		b2 = _mm_set1_epi8(iec61937_sync[2]), b3 = _mm_set1_epi8(iec61937_sync[3]);
+
+	for(; i + 16 + 3 <= length; i += 16)
+	{
+		__m128i m = _mm_and_si128(
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i)), b0),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 1)), b1)),
+				_mm_and_si128(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 2)), b2),
+					_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(data + i + 3)), b3)));
+		int mask = _mm_movemask_epi8(m);
+		if(mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON)
+	const uint8x16_t b0 = vdupq_n_u8(iec61937_sync[0]), b1 = vdupq_n_u8(iec61937_sync[1]),
+		b2 = vdupq_n_u8(iec61937_sync[2]), b3 = vdupq_n_u8(iec61937_sync[3]);
+
+	for(; i + 16 + 3 <= length; i += 16)
+	{
+		uint8x16_t m = vandq_u8(
+				vandq_u8(vceqq_u8(vld1q_u8(data + i), b0), vceqq_u8(vld1q_u8(data + i + 1), b1)),
+				vandq_u8(vceqq_u8(vld1q_u8(data + i + 2), b2), vceqq_u8(vld1q_u8(data + i + 3), b3)));
+		/* Narrow each byte of the mask to a nibble to get a 64-bit bitmap */
+		uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+		if(mask)
+			return i + (__builtin_ctzll(mask) >> 2);
+	}
+#endif
+
+	/* Scalar fallback and tail: let memchr() skip to candidates */
+	while(i + 4 <= length && (p = memchr(data + i, iec61937_sync[0], length - 3 - i)))
+	{
+		i = p - data;
+		if(!memcmp(p, iec61937_sync, sizeof(iec61937_sync)))
+			return i;
+		i++;
+	}
+
+	return length;
+}
+
+/* Stores the offsets of up to max sync words found in data, returns the number stored */
+size_t iec61937_sync_offsets(const uint8_t *data, size_t length, size_t *offsets, size_t max)
+{
+	size_t n = 0, i = 0;
+
+	while(n < max && (i += iec61937_find_sync(data + i, length - i)) < length)
+		offsets[n++] = i++;
+
+	return n;
+}
+
+/* IEC61937 data types as found in bits 0-4 of Pc, see IEC 61937-2 */
+enum iec61937_data_type
+{
+	IEC61937_NULL = 0x00,
+	IEC61937_AC3 = 0x01,
+	IEC61937_PAUSE = 0x03,
+	IEC61937_MPEG1_LAYER1 = 0x04,
+	IEC61937_MPEG1_LAYER23 = 0x05,
+	IEC61937_MPEG2_EXT = 0x06,
+	IEC61937_MPEG2_AAC = 0x07,
+	IEC61937_MPEG2_LAYER1_LSF = 0x08,
+	IEC61937_MPEG2_LAYER2_LSF = 0x09,
+	IEC61937_MPEG2_LAYER3_LSF = 0x0A,
+	IEC61937_DTS1 = 0x0B,
+	IEC61937_DTS2 = 0x0C,
+	IEC61937_DTS3 = 0x0D,
+	IEC61937_DTSHD = 0x11,
+	IEC61937_MPEG2_AAC_LSF = 0x13,
+	IEC61937_EAC3 = 0x15,
+	IEC61937_TRUEHD = 0x16
+};
+
+#define IEC61937_HEADER_SIZE 8
+
+/* Payload size in bytes from the Pd length code. It is in bits for most data
+ * types and in bytes for the ones that may exceed 8 KiB */
+static size_t iec61937_payload_size(uint16_t pc, uint16_t pd)
+{
+	switch(pc & 0x1F)
+	{
+		case IEC61937_DTSHD:
+		case IEC61937_EAC3:
+		case IEC61937_TRUEHD:
+			return (pd + 1) & ~1;
+		default:
+			return ((pd + 15) >> 4) << 1;
+	}
+}
+
+static uint16_t iec61937_last_pc = IEC61937_NULL;	/* of the burst in pkt */
+
+/* Takes the next complete data burst from the start of rb. The payload is
+ * converted to big-endian byte order in place and pkt is pointed straight at
+ * it, so it is only valid until more data is written to rb.
+ * Returns 1 if pkt is filled and 0 if more data is needed */
+static int iec61937_parse_burst(struct ringbuffer *rb, AVPacket *pkt)
+{
+	size_t offset, length, payload, i;
+	uint8_t *data;
+	uint16_t pc, pd;
+
+	for(;;)
+	{
+		data = ringbuffer_read_ptr(rb);
+		length = ringbuffer_length(rb);
+
+		/* Skip the stuffing, but keep what may be the start of a sync word */
+		if((offset = iec61937_find_sync(data, length)) == length)
+		{
+			if(length > sizeof(iec61937_sync) - 1)
+			{
+				ringbuffer_drop(rb, length - (sizeof(iec61937_sync) - 1));
+				iec61937_since_burst += length - (sizeof(iec61937_sync) - 1);
+			}
+			return 0;
+		}
+
+		ringbuffer_drop(rb, offset);
+		iec61937_since_burst += offset;
+		data += offset;
+		length -= offset;
+
+		if(length < IEC61937_HEADER_SIZE)
+			return 0;
+
+		pc = data[4] | data[5] << 8;
+		pd = data[6] | data[7] << 8;
+		payload = iec61937_payload_size(pc, pd);
+
+		if(length < IEC61937_HEADER_SIZE + payload)
+			return 0;
+
+		ringbuffer_drop(rb, IEC61937_HEADER_SIZE + payload);
+
+		/* Null and pause bursts carry no audio, nothing is lost in a pause */
+		if((pc & 0x1F) == IEC61937_NULL || (pc & 0x1F) == IEC61937_PAUSE || !payload)
+		{
+			iec61937_since_burst = IEC61937_HEADER_SIZE + payload;
+			continue;
+		}
+
+		iec61937_burst_distance = iec61937_since_burst;
+		iec61937_since_burst = IEC61937_HEADER_SIZE + payload;
+
+		data += IEC61937_HEADER_SIZE;
+		for(i = 0; i + 1 < payload; i += 2)
+		{
+			uint8_t t = data[i];
+			data[i] = data[i + 1];
+			data[i + 1] = t;
+		}
+
+		/* DTS type IV frames are preceded by a start code and their size */
+		if((pc & 0x1F) == IEC61937_DTSHD && payload > 12 && data[0] == 0x01 && data[8] == 0xFE && data[9] == 0xFE)
+		{
+			data += 12;
+			payload -= 12;
+		}
+
+		pkt->data = data;
+		pkt->size = payload;
+		iec61937_last_pc = pc;
+		return 1;
+	}
+}
+
+/* Maps the data type in Pc to the decoder for it */
+static enum AVCodecID iec61937_codec_id(uint16_t pc)
+{
+	switch(pc & 0x1F)
+	{
+		case IEC61937_AC3:
+			return AV_CODEC_ID_AC3;
+		case IEC61937_MPEG1_LAYER1:
+		case IEC61937_MPEG2_LAYER1_LSF:
+			return AV_CODEC_ID_MP1;
+		case IEC61937_MPEG1_LAYER23:
+		case IEC61937_MPEG2_EXT:
+		case IEC61937_MPEG2_LAYER2_LSF:
+		case IEC61937_MPEG2_LAYER3_LSF:
+			return AV_CODEC_ID_MP3;
+		case IEC61937_MPEG2_AAC:
+		case IEC61937_MPEG2_AAC_LSF:
+			return AV_CODEC_ID_AAC;
+		case IEC61937_DTS1:
+		case IEC61937_DTS2:
+		case IEC61937_DTS3:
+		case IEC61937_DTSHD:
+			return AV_CODEC_ID_DTS;
+		case IEC61937_EAC3:
+			return AV_CODEC_ID_EAC3;
+		case IEC61937_TRUEHD:
+			return AV_CODEC_ID_TRUEHD;
+		default:
+			return AV_CODEC_ID_NONE;
+	}
+}
+
+/* Returns Pc of the first burst in rb without consuming anything, or
+ * IEC61937_NULL if there is none */
+static uint16_t iec61937_peek_pc(const struct ringbuffer *rb)
+{
+	const uint8_t *data = ringbuffer_read_ptr(rb);
+	size_t length = ringbuffer_length(rb);
+	size_t offset = iec61937_find_sync(data, length);
+
+	if(offset + IEC61937_HEADER_SIZE > length)
+		return IEC61937_NULL;
+
+	return data[offset + 4] | data[offset + 5] << 8;
+}
+
+/* Returns the codec of the first burst in rb without consuming anything */
+static enum AVCodecID iec61937_peek_codec_id(const struct ringbuffer *rb)
+{
+	return iec61937_codec_id(iec61937_peek_pc(rb));
+}
+
+/* Reads n bits at bit pos of a codec frame in a burst payload, which
+ * IEC61937 carries in little endian 16 bit words */
+static uint32_t iec61937_payload_bits(const uint8_t *payload, unsigned pos, unsigned n)
+{
+	uint32_t v = 0;
+
+	for(; n; n--, pos++)
+		v = v << 1 | (payload[(pos >> 3) ^ 1] >> (7 - (pos & 7)) & 1);
+
+	return v;
+}
+
+/* AC-3 and E-AC-3 sync frame header, see ATSC A/52 5.4.1 and E.1.2 */
+static int ac3_header_format(const uint8_t *p, size_t length, struct decoded_format *f)
+{
+	static const uint64_t acmod_layouts[8] = {
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_BACK_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER | AV_CH_BACK_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT
+	};
+	static const int rates[4] = {48000, 44100, 32000, 0};
+	unsigned bsid, fscod, acmod, lfeon, pos;
+
+	if(length < 8 || iec61937_payload_bits(p, 0, 16) != 0x0B77)
+		return -1;
+
+	bsid = iec61937_payload_bits(p, 40, 5);
+	fscod = iec61937_payload_bits(p, 32, 2);
+
+	if(bsid > 10)
+	{
+		f->sample_rate = fscod == 3 ? rates[iec61937_payload_bits(p, 34, 2)] / 2 : rates[fscod];
+		acmod = iec61937_payload_bits(p, 36, 3);
+		lfeon = iec61937_payload_bits(p, 39, 1);
+	}
+	else
+	{
+		/* bsid 9 and 10 are the half and quarter rate variants */
+		f->sample_rate = rates[fscod] >> (bsid > 8 ? bsid - 8 : 0);
+		acmod = iec61937_payload_bits(p, 48, 3);
+		pos = 51;
+		if((acmod & 1) && acmod != 1)
+			pos += 2;	/* cmixlev */
+		if(acmod & 4)
+			pos += 2;	/* surmixlev */
+		if(acmod == 2)
+			pos += 2;	/* dsurmod */
+		lfeon = iec61937_payload_bits(p, pos, 1);
+	}
+
+	if(!f->sample_rate)
+		return -1;
+
+	av_channel_layout_from_mask(&f->ch_layout, acmod_layouts[acmod] | (lfeon ? AV_CH_LOW_FREQUENCY : 0));
+	f->sample_fmt = AV_SAMPLE_FMT_FLTP;
+	return 0;
+}
+
+/* DTS core frame header, see ETSI TS 102 114 5.3.1. Fails if an extension
+ * may add channels the core header does not tell */
+static int dts_header_format(const uint8_t *p, size_t length, struct decoded_format *f)
+{
+	static const uint64_t amode_layouts[10] = {
+		AV_CH_FRONT_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_BACK_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER | AV_CH_BACK_CENTER,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT,
+		AV_CH_FRONT_LEFT | AV_CH_FRONT_RIGHT | AV_CH_FRONT_CENTER | AV_CH_SIDE_LEFT | AV_CH_SIDE_RIGHT
+	};
+	static const int rates[16] = {0, 8000, 16000, 32000, 0, 0, 11025, 22050, 44100, 0, 0, 12000, 24000, 48000, 96000, 192000};
+	unsigned amode;
+
+	if(length < 12 || iec61937_payload_bits(p, 0, 32) != 0x7FFE8001)
+		return -1;
+
+	amode = iec61937_payload_bits(p, 60, 6);
+	f->sample_rate = rates[iec61937_payload_bits(p, 66, 4)];
+
+	if(amode >= sizeof(amode_layouts) / sizeof(amode_layouts[0]) || !f->sample_rate || iec61937_payload_bits(p, 82, 1))
+		return -1;
+
+	av_channel_layout_from_mask(&f->ch_layout, amode_layouts[amode] | (iec61937_payload_bits(p, 84, 2) ? AV_CH_LOW_FREQUENCY : 0));
+	f->sample_fmt = AV_SAMPLE_FMT_FLTP;
+	return 0;
+}
+
+/* Tells the format the decoder will put out from the frame header in the first
+ * burst of rb. Fails for the codecs it cannot be told for before decoding,
+ * including DTS-HD, whose extension substreams may change all of it */
+static int iec61937_peek_format(const struct ringbuffer *rb, struct decoded_format *f)
+{
+	const uint8_t *data = ringbuffer_read_ptr(rb);
+	size_t length = ringbuffer_length(rb);
+	size_t offset = iec61937_find_sync(data, length);
+
+	if(offset + IEC61937_HEADER_SIZE > length)
+		return -1;
+
+	switch(data[offset + 4] & 0x1F)
+	{
+		case IEC61937_AC3:
+		case IEC61937_EAC3:
+			return ac3_header_format(data + offset + IEC61937_HEADER_SIZE, length - offset - IEC61937_HEADER_SIZE, f);
+		case IEC61937_DTS1:
+		case IEC61937_DTS2:
+		case IEC61937_DTS3:
+			return dts_header_format(data + offset + IEC61937_HEADER_SIZE, length - offset - IEC61937_HEADER_SIZE, f);
+		default:
+			return -1;
+	}
+}
+
+/* Searches for the next sync word from where the previous search stopped.
+ * Returns its offset or length if there is none yet */
+static size_t iec61937_track_search(struct iec61937_tracker *t, const uint8_t *data, size_t length)
+{
+	size_t found;
+
+	if(t->scanned >= length)
+		return length;
+
+	found = t->scanned + iec61937_find_sync(data + t->scanned, length - t->scanned);
+
+	if(found < length)
+		t->scanned = found + 1;
+	else if(length > sizeof(iec61937_sync) - 1)
+		t->scanned = length - (sizeof(iec61937_sync) - 1); /* the tail may be the start of a sync word */
+
+	return found;
+}
+
+// Feeds the data accumulated so far (the same buffer, only grown since the last call) to the lock-on tracker.
+// returns 0 if data is too small for examination, 1 if validation fails and a block size (aka offset) if validation is successful
+size_t iec61937_track(struct iec61937_tracker *t, const uint8_t* data, size_t length)
+{
+	size_t found;
+
+	for(;;)
+	{
+		if(t->syncs == 0)
+		{
+			if((found = iec61937_track_search(t, data, length)) == length)
+				return length < SPDIF_MAX_OFFSET ? 0 : 1;
+
+			t->first = found;
+			t->syncs = 1;
+		}
+
+		if(t->syncs == 1)
+		{
+			/* Pd tells how much payload to skip before looking for the next burst */
+			if(t->first + 8 > length)
+				return 0;
+
+			size_t payload_end = t->first + ((*(uint16_t*)(data+t->first+6))>>3) + 8;
+			if(t->scanned < payload_end)
+				t->scanned = payload_end;
+
+			if((found = iec61937_track_search(t, data, length)) == length)
+				return length < SPDIF_MAX_OFFSET * 2 ? 0 : 1;
+
+			t->period = found - t->first;
+			if(t->period > SPDIF_MAX_OFFSET)
+				return 1;
+
+			t->syncs = 2;
+		}
+
+		/* The spacing is confirmed once the third burst starts exactly one period later */
+		size_t third = t->first + t->period * 2;
+		if(third + sizeof(iec61937_sync) > length)
+			return 0;
+
+		if(!memcmp(data + third, iec61937_sync, sizeof(iec61937_sync)))
+			return t->period;
+
+		if(length >= SPDIF_MAX_OFFSET * 2)
+			return 1;
+
+		/* Not a steady burst sequence, start over from the second sync word */
+		t->first += t->period;
+		t->scanned = t->first + 1;
+		t->syncs = 1;
+	}
+}
+
+//returns 1 if magic found, 0 if not
+int iec61937_suspect(const uint8_t* data, size_t length)
+{
+	return iec61937_find_sync(data, length) < length ? 1 : 0;
+}
+
+/* Returns 1 if all bytes are zero */
+static int buffer_is_zero(const void *data, size_t length)
+{
+	const uint8_t *p = data;
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc = zero;
+
+	for(; i + 16 <= length; i += 16)
+		acc = _mm_or_si128(acc, _mm_loadu_si128((const __m128i*)(p + i)));
+
+	if(_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+		return 0;
+#elif defined(__ARM_NEON)
+	uint8x16_t acc = vdupq_n_u8(0);
+
+	for(; i + 16 <= length; i += 16)
+		acc = vorrq_u8(acc, vld1q_u8(p + i));
+
+	uint64x2_t acc64 = vreinterpretq_u64_u8(acc);
+	if(vgetq_lane_u64(acc64, 0) | vgetq_lane_u64(acc64, 1))
+		return 0;
+#endif
+
+	for(; i < length; i++)
+		if(p[i])
+			return 0;
+
+	return 1;
+}
+
+/* Accumulates peak, sum and sum of squares of S16 samples into 8 lanes, lane k
+ * holding every sample whose index modulo 8 is k. Returns the number of samples
+ * processed, the remainder is left for the scalar loop */
+static size_t analyze_s16_simd(const int16_t *p, size_t samples, int16_t peak[8], int64_t sum[8], uint64_t sumsq[8])
+{
+	size_t i = 0, chunk_end;
+	int k;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i vpeak = zero, sq0 = zero, sq1 = zero, sq2 = zero, sq3 = zero;
+	int16_t tpeak[8];
+	int32_t tsum[8];
+	uint64_t tsq[8];
+
+	while(i + 8 <= samples)
+	{
+		/* 32-bit sums of 16-bit samples are safe for 65535 iterations */
+		__m128i s0 = zero, s1 = zero;
+		chunk_end = samples - i > 8*32768 ? i + 8*32768 : samples;
+
+		for(; i + 8 <= chunk_end; i += 8)
+		{
+			__m128i x = _mm_loadu_si128((const __m128i*)(p + i));
+			vpeak = _mm_max_epi16(vpeak, _mm_max_epi16(x, _mm_subs_epi16(zero, x)));
+			s0 = _mm_add_epi32(s0, _mm_srai_epi32(_mm_unpacklo_epi16(zero, x), 16));
+			s1 = _mm_add_epi32(s1, _mm_srai_epi32(_mm_unpackhi_epi16(zero, x), 16));
+			__m128i lo = _mm_unpacklo_epi16(x, zero), hi = _mm_unpackhi_epi16(x, zero);
+			lo = _mm_madd_epi16(lo, lo);
+			hi = _mm_madd_epi16(hi, hi);
+			sq0 = _mm_add_epi64(sq0, _mm_unpacklo_epi32(lo, zero));
+			sq1 = _mm_add_epi64(sq1, _mm_unpackhi_epi32(lo, zero));
+			sq2 = _mm_add_epi64(sq2, _mm_unpacklo_epi32(hi, zero));
+			sq3 = _mm_add_epi64(sq3, _mm_unpackhi_epi32(hi, zero));
+		}
+
+		_mm_storeu_si128((__m128i*) tsum, s0);
+		_mm_storeu_si128((__m128i*) (tsum + 4), s1);
+		for(k = 0; k < 8; k++)
+			sum[k] += tsum[k];
+	}
+
+	_mm_storeu_si128((__m128i*) tpeak, vpeak);
+	_mm_storeu_si128((__m128i*) tsq, sq0);
+	_mm_storeu_si128((__m128i*) (tsq + 2), sq1);
+	_mm_storeu_si128((__m128i*) (tsq + 4), sq2);
+	_mm_storeu_si128((__m128i*) (tsq + 6), sq3);
+	for(k = 0; k < 8; k++)
+	{
+		if(tpeak[k] > peak[k])
+			peak[k] = tpeak[k];
+		sumsq[k] += tsq[k];
+	}
+#elif defined(__ARM_NEON)
+	int16x8_t vpeak = vdupq_n_s16(0);
+	int64x2_t sq0 = vdupq_n_s64(0), sq1 = sq0, sq2 = sq0, sq3 = sq0;
+	int16_t tpeak[8];
+	int32_t tsum[8];
+	int64_t tsq[8];
+
+	while(i + 8 <= samples)
+	{
+		/* 32-bit sums of 16-bit samples are safe for 65535 iterations */
+		int32x4_t s0 = vdupq_n_s32(0), s1 = s0;
+		chunk_end = samples - i > 8*32768 ? i + 8*32768 : samples;
+
+		for(; i + 8 <= chunk_end; i += 8)
+		{
+			int16x8_t x = vld1q_s16(p + i);
+			int16x4_t xl = vget_low_s16(x), xh = vget_high_s16(x);
+			vpeak = vmaxq_s16(vpeak, vqabsq_s16(x));
+			s0 = vaddw_s16(s0, xl);
+			s1 = vaddw_s16(s1, xh);
+			int32x4_t lo = vmull_s16(xl, xl), hi = vmull_s16(xh, xh);
+			sq0 = vaddw_s32(sq0, vget_low_s32(lo));
+			sq1 = vaddw_s32(sq1, vget_high_s32(lo));
+			sq2 = vaddw_s32(sq2, vget_low_s32(hi));
+			sq3 = vaddw_s32(sq3, vget_high_s32(hi));
+		}
+
+		vst1q_s32(tsum, s0);
+		vst1q_s32(tsum + 4, s1);
+		for(k = 0; k < 8; k++)
+			sum[k] += tsum[k];
+	}
+
+	vst1q_s16(tpeak, vpeak);
+	vst1q_s64(tsq, sq0);
+	vst1q_s64(tsq + 2, sq1);
+	vst1q_s64(tsq + 4, sq2);
+	vst1q_s64(tsq + 6, sq3);
+	for(k = 0; k < 8; k++)
+	{
+		if(tpeak[k] > peak[k])
+			peak[k] = tpeak[k];
+		sumsq[k] += tsq[k];
+	}
+#endif
+
+	return i;
+}
+
+/* Examines a fragment of input in a single pass: all-zero and DC-only
+ * detection plus per-channel peak, RMS and DC offset. Level metering is only
+ * done for native-endian S16, other formats get the all-zero check only */
+static void analyze_signal(const void *data, size_t length, const pa_sample_spec *spec, struct signal_analysis *a)
+{
+	int16_t peak[8] = {0};
+	int64_t sum[8] = {0};
+	uint64_t sumsq[8] = {0};
+	unsigned channels = spec->channels, c;
+	size_t i = 0;
+
+	memset(a, 0, sizeof(*a));
+
+	if(spec->format != PA_SAMPLE_S16NE || !channels || channels > ANALYZER_MAX_CHANNELS)
+	{
+		a->zero = a->silent = buffer_is_zero(data, length);
+		return;
+	}
+
+	const int16_t *p = data;
+	size_t samples = length / sizeof(int16_t) / channels * channels;
+
+	a->channels = channels;
+	a->frames = samples / channels;
+
+	if(8 % channels == 0)
+		i = analyze_s16_simd(p, samples, peak, sum, sumsq);
+
+	/* Lanes below the channel count map to themselves when folded below */
+	for(; i < samples; i++)
+	{
+		int32_t x = p[i];
+		c = i % channels;
+		if(abs(x) > peak[c])
+			peak[c] = abs(x) > INT16_MAX ? INT16_MAX : abs(x);
+		sum[c] += x;
+		sumsq[c] += (uint64_t)(x * x);
+	}
+
+	a->zero = buffer_is_zero(p + samples, length - samples * sizeof(int16_t));
+	a->dc = a->frames > 0;
+
+	for(i = 0; i < 8; i++)
+	{
+		c = i % channels;
+		if(peak[i] > a->peak[c])
+			a->peak[c] = peak[i];
+		a->sum[c] += sum[i];
+		a->sumsq[c] += sumsq[i];
+	}
+
+	for(c = 0; c < channels; c++)
+	{
+		if(a->peak[c])
+			a->zero = 0;
+		/* The channel is constant if every sample has the peak magnitude and the same sign */
+		if(a->sumsq[c] != (uint64_t)a->peak[c] * a->peak[c] * a->frames || llabs(a->sum[c]) != (int64_t)a->peak[c] * a->frames)
+			a->dc = 0;
+	}
+
+	a->silent = a->zero || a->dc;
+}
+
+/* Sets the decoder's threads up before it is opened. Each frame thread past the
+ * first holds a burst back, so their number is capped to what the latency
+ * budget allows: half of --latency, or DECODER_FRAME_DELAY bursts. Slice
+ * threads add no delay. Most audio decoders have neither and stay on one */
+static void setup_decoder_threads(const AVCodec *dec)
+{
+	int threads = decoder_threads ? decoder_threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+	int type = decoder_thread_type;
+
+	if(threads > 1 && (type & FF_THREAD_FRAME) && (dec->capabilities & AV_CODEC_CAP_FRAME_THREADS))
+	{
+		pa_usec_t burst = pa_bytes_to_usec(block_size, &in_sample_spec);
+		pa_usec_t budget = target_latency ? target_latency / 2 : burst * DECODER_FRAME_DELAY;
+		int max = burst ? 1 + (int)(budget / burst) : 1;
+
+		if(threads > max)
+		{
+			if(verbose)
+				fprintf(stderr, "Limiting %s to %d frame threads, %zu usec of decoder delay\n", dec->name, max, (size_t)((max - 1) * burst));
+			threads = max;
+		}
+	}
+
+	if(threads > 1 && !(dec->capabilities & (AV_CODEC_CAP_FRAME_THREADS | AV_CODEC_CAP_SLICE_THREADS)) && verbose)
+		fprintf(stderr, "The %s decoder is single-threaded\n", dec->name);
+
+	avcodeccontext->thread_count = threads < 1 ? 1 : threads;
+	avcodeccontext->thread_type = type;
+}
+
+/* Opens a decoder for the codec named by Pc. There is no probing pass, the
+ * stream parameters come with the first decoded frame */
+static int open_decoder(enum AVCodecID codec_id)
+{
+	const AVCodec *dec;
+	int r;
+
+	if(codec_id == AV_CODEC_ID_NONE)
+	{
+		fprintf(stderr, "Unsupported IEC61937 data type\n");
+		return AVERROR_PATCHWELCOME;
+	}
+
+	if(!(dec = avcodec_find_decoder(codec_id)))
+	{
+		fprintf(stderr, "No decoder for %s\n", avcodec_get_name(codec_id));
+		return AVERROR_DECODER_NOT_FOUND;
+	}
+
+	avcodeccontext = avcodec_alloc_context3(dec);
+	decoder_opens++;
+
+	if(decoder_threads != 1)
+		setup_decoder_threads(dec);
+
+	if ((r = avcodec_open2(avcodeccontext, dec, NULL)) < 0)
+	{
+		print_averror("avcodec_open2", r);
+		avcodec_free_context(&avcodeccontext);
+	}
+	else if (verbose && avcodeccontext->active_thread_type)
+		fprintf(stderr, "Decoding %s with %d %s threads\n", dec->name, avcodeccontext->thread_count,
+				avcodeccontext->active_thread_type == FF_THREAD_FRAME ? "frame" : "slice");
+
+	return r;
+}
+
+/* Makes room in outbuffer from the decode thread while it does not hold the
+ * mainloop lock. Growing needs the lock as the write callback reads from it */
+static void outbuffer_reserve_unlocked(size_t l)
+{
+	if (ringbuffer_space(&outbuffer) >= l)
+		return;
+
+	decoder_lock();
+	ringbuffer_reserve(&outbuffer, l);
+	decoder_unlock();
+}
+
+/* Converts a decoded frame into a buffer owned by the output stream, saving the
+ * copy out of outbuffer. Returns 0 if the stream cannot take outsamples right now.
+ * Called without the mainloop lock, it is only held to get and hand back the
+ * buffer. In between the mainloop thread leaves the output alone, as
+ * outbuffer is empty and output_direct_write is set. *stream_open is
+ * refreshed meanwhile */
+static int convert_direct(AVFrame *frame, int outsamples, int *stream_open)
+{
+	void *buf;
+	size_t l;
+	int r;
+
+	decoder_lock();
+	*stream_open = output_open();
+	l = stream_begin_write(&buf, (size_t)outsamples * out_bytes_per_sample, (size_t)-1);
+	output_direct_write = l != 0;
+	decoder_unlock();
+
+	if (!l)
+		return 0;
+
+	uint8_t *outptr = buf;
+	uint64_t t = trace_begin();
+	r = swr_convert(swrcontext, &outptr, l / out_bytes_per_sample, (const uint8_t **) frame->extended_data, frame->nb_samples);
+	trace_end("swr_convert", t);
+
+	decoder_lock();
+	output_direct_write = 0;
+	if (r < 0)
+		output->cancel_write();
+	else
+		stream_commit_write(buf, (size_t)r * out_bytes_per_sample);
+	decoder_unlock();
+
+	if (r < 0)
+		print_averror("swr_convert", r);
+	return 1;
+}
+
+/* Decode plus conversion time of every burst, collected by --bench */
+static uint64_t *bench_burst_times = NULL;
+static size_t bench_burst_count = 0, bench_burst_alloc = 0;
+
+static void bench_reserve_bursts(size_t count)
+{
+	if (count > bench_burst_alloc)
+	{
+		bench_burst_alloc = count;
+		bench_burst_times = pa_xrealloc(bench_burst_times, bench_burst_alloc * sizeof(*bench_burst_times));
+	}
+}
+
+static void bench_record_burst(uint64_t nsec)
+{
+	if (bench_burst_count == bench_burst_alloc)
+		bench_reserve_bursts(bench_burst_alloc ? bench_burst_alloc * 2 : 4096);
+	bench_burst_times[bench_burst_count++] = nsec;
+}
+
+/* Fills the time of lost bursts with silence, so the output clock runs on
+ * and the stream stays up. Called with the mainloop lock held */
+static void conceal_bursts(int count)
+{
+	/* Bursts still in the decoder before the first frame are not lost */
+	if(!iec61937_announced || !swrcontext || !output_open())
+		return;
+
+	size_t frames = (size_t)count * block_size / pa_frame_size(&in_sample_spec) * out_sample_spec.rate / in_sample_spec.rate;
+	size_t l = frames * out_bytes_per_sample;
+
+	ringbuffer_reserve(&outbuffer, l);
+	uint8_t *outptr = ringbuffer_write_ptr(&outbuffer);
+	av_samples_set_silence(&outptr, 0, frames, out_sample_spec.channels, swroutformat);
+	ringbuffer_commit(&outbuffer, l);
+
+	concealed_frames += count;
+	if(verbose)
+		fprintf(stderr, "Concealed %d lost burst%s\n", count, count == 1 ? "" : "s");
+}
+
+/* The same from the decode thread while it does not hold the mainloop lock */
+static void conceal_bursts_unlocked(int count)
+{
+	decoder_lock();
+	conceal_bursts(count);
+	decoder_unlock();
+}
+
+/* Decodes every complete burst in inbuffer into outbuffer, with silence in
+ * place of the ones lost. Runs without the mainloop lock, it is only taken
+ * to reconfigure the output and to conceal. stream_open is output_open() as
+ * the caller saw it with the lock held, it is refreshed whenever it is taken.
+ * Returns the number of frames decoded or a negative error code */
+static int decode_bursts(int stream_open)
+{
+	int ret, fcount = 0;
+	uint64_t t;
+
+	for (;;)
+	{
+		t = trace_begin();
+		ret = iec61937_parse_burst(&inbuffer, pkt);
+		trace_end("iec61937_parse_burst", t);
+		if (!ret)
+			break;
+
+		uint64_t burst_start = offline ? trace_now() : 0;
+
+		if (iec61937_codec_id(iec61937_last_pc) != avcodeccontext->codec_id)
+		{
+			fprintf(stderr, "Compressed format changed\n");
+			return AVERROR_INVALIDDATA;
+		}
+
+		/* Bursts lost in the stuffing before this one are filled in before it */
+		size_t lost = (iec61937_burst_distance + block_size / 2) / block_size;
+		if (lost > 1)
+			conceal_bursts_unlocked(lost - 1);
+
+		int slotted = packet_slot_fill(pkt);
+
+		t = trace_begin();
+		alloc_decoder(1);
+		ret = avcodec_send_packet(avcodeccontext, pkt);
+		alloc_decoder(0);
+		trace_end("avcodec_send_packet", t);
+
+		/* The slot keeps its own reference */
+		if (slotted)
+			pkt->buf = NULL;
+		if (ret < 0)
+		{
+			print_averror("avcodec_send_packet", ret);
+			conceal_bursts_unlocked(1);
+			continue;
+		}
+
+		for (;;)
+		{
+			t = trace_begin();
+			alloc_decoder(1);
+			ret = avcodec_receive_frame(avcodeccontext, avframe);
+			alloc_decoder(0);
+			trace_end("avcodec_receive_frame", t);
+			if (ret < 0)
+				break;
+
+			int matches = swrcontext && decoded_format_matches(&decoded_format, avframe);
+
+			/* The counters are read on the mainloop thread */
+			if(decoder_cache_pending)
+			{
+				decoder_lock();
+				if(matches)
+					decoder_cache_hits++;
+				else
+					decoder_cache_misses++;
+				decoder_unlock();
+				decoder_cache_pending = 0;
+			}
+
+			/* The output format is only known once the first frame is decoded */
+			if(!matches || !stream_open || !iec61937_announced)
+			{
+				decoder_lock();
+
+				if(!matches)
+				{
+					if(swrcontext)
+						fprintf(stderr, "Decoded audio format changed\n");
+					if((ret = setup_converter(avframe->sample_rate, &avframe->ch_layout, avframe->format)) < 0)
+					{
+						decoder_unlock();
+						av_frame_unref(avframe);
+						return ret;
+					}
+					close_output_stream();
+				}
+
+				/* A pinned stream is still open from before */
+				if(!output_open() || !iec61937_announced)
+				{
+					char buf[256];
+					avcodec_string(buf, sizeof(buf), avcodeccontext, 0);
+					fprintf(stderr, "Playing IEC61937: %s\n", buf);
+					iec61937_announced = 1;
+				}
+
+				if(!output_open())
+					open_output_stream();
+
+				stream_open = output_open();
+				decoder_unlock();
+			}
+
+			apply_compensation(swrcontext);
+
+			int outsamples = swr_get_out_samples(swrcontext, avframe->nb_samples);
+			int converted = 0;
+
+			/* Convert straight into the stream's buffer when the whole frame
+			 * fits, otherwise it goes to outbuffer behind what is pending */
+			if(!ringbuffer_length(&outbuffer))
+				converted = convert_direct(avframe, outsamples, &stream_open);
+
+			if(!converted)
+			{
+				outbuffer_reserve_unlocked(outsamples * out_bytes_per_sample);
+				uint8_t *outptr = ringbuffer_write_ptr(&outbuffer);
+				t = trace_begin();
+				int r = swr_convert(swrcontext, &outptr, outsamples, (const uint8_t **) avframe->extended_data, avframe->nb_samples);
+				trace_end("swr_convert", t);
+				if(r < 0)
+					print_averror("swr_convert", r);
+				else
+					ringbuffer_commit(&outbuffer, (size_t)r * out_bytes_per_sample);
+			}
+
+			fcount++;
+
+			/* The first frame is out, the stream is set up */
+			alloc_steady(stream_open);
+			av_frame_unref(avframe);
+		}
+
+		if(ret != AVERROR(EAGAIN))
+		{
+			print_averror("avcodec_receive_frame", ret);
+			conceal_bursts_unlocked(1);
+			continue;
+		}
+
+		if(burst_start)
+			bench_record_burst(trace_now() - burst_start);
+	}
+
+	return fcount;
+}
+
+/* PulseAudio encoding of an IEC61937 data type, if there is one */
+static pa_encoding_t passthrough_encoding_of(uint16_t pc)
+{
+	switch(pc & 0x1F)
+	{
+		case IEC61937_AC3:
+			return PA_ENCODING_AC3_IEC61937;
+		case IEC61937_EAC3:
+			return PA_ENCODING_EAC3_IEC61937;
+		case IEC61937_MPEG1_LAYER1:
+		case IEC61937_MPEG1_LAYER23:
+		case IEC61937_MPEG2_EXT:
+		case IEC61937_MPEG2_LAYER1_LSF:
+		case IEC61937_MPEG2_LAYER2_LSF:
+		case IEC61937_MPEG2_LAYER3_LSF:
+			return PA_ENCODING_MPEG_IEC61937;
+		case IEC61937_MPEG2_AAC:
+		case IEC61937_MPEG2_AAC_LSF:
+			return PA_ENCODING_MPEG2_AAC_IEC61937;
+		case IEC61937_DTS1:
+		case IEC61937_DTS2:
+		case IEC61937_DTS3:
+			return PA_ENCODING_DTS_IEC61937;
+#if PA_CHECK_VERSION(13, 0, 0)
+		case IEC61937_DTSHD:
+			return PA_ENCODING_DTSHD_IEC61937;
+		case IEC61937_TRUEHD:
+			return PA_ENCODING_TRUEHD_IEC61937;
+#endif
+		default:
+			return PA_ENCODING_INVALID;
+	}
+}
+
+/* Opens a passthrough stream for the bursts in inbuffer unless the sink has
+ * turned their encoding down before. Returns 1 if they are passed through */
+static int passthrough_start(enum AVCodecID codec_id)
+{
+	pa_encoding_t encoding = passthrough_encoding_of(iec61937_peek_pc(&inbuffer));
+
+	if(!passthrough || encoding == PA_ENCODING_INVALID || (passthrough_rejected & 1u << encoding))
+		return 0;
+
+	fprintf(stderr, "Playing IEC61937 passthrough: %s\n", pa_encoding_to_string(encoding));
+
+	/* The sink gets whole bursts from the first one on */
+	ringbuffer_drop(&inbuffer, iec61937_find_sync(ringbuffer_read_ptr(&inbuffer), ringbuffer_length(&inbuffer)) & ~(size_t)3);
+
+	out_sample_spec = in_sample_spec;
+	tlength = block_size * 2;
+	ringbuffer_reserve(&outbuffer, (size_t)tlength * 16);
+
+	if(output->open_passthrough(encoding, &out_sample_spec) < 0)
+	{
+		passthrough_rejected |= 1u << encoding;
+		return 0;
+	}
+
+	passthrough_codec = codec_id;
+	passthrough_encoding = encoding;
+	return 1;
+}
+
+/* Sends inbuffer to the passthrough stream as it is, but for a burst header
+ * that may be cut short, which waits for the next read. Returns the number of
+ * bursts sent, or -1 without sending anything if a burst of another codec has
+ * shown up */
+static int passthrough_forward(void)
+{
+	const uint8_t *data = ringbuffer_read_ptr(&inbuffer);
+	size_t length = ringbuffer_length(&inbuffer);
+	size_t send = length > IEC61937_HEADER_SIZE ? (length - IEC61937_HEADER_SIZE) & ~(size_t)3 : 0;
+	size_t offsets[16], n, i, from, l;
+	int bursts = 0;
+
+	/* Every sync word that starts before send, its Pc is in already */
+	size_t span = send ? send + sizeof(iec61937_sync) - 1 : 0;
+
+	for(from = 0; (n = iec61937_sync_offsets(data + from, span - from, offsets, sizeof(offsets) / sizeof(offsets[0]))); from += offsets[n - 1] + 1)
+		for(i = 0; i < n; i++)
+		{
+			const uint8_t *pc = data + from + offsets[i] + 4;
+			enum AVCodecID codec_id = iec61937_codec_id(pc[0] | pc[1] << 8);
+			if(codec_id != AV_CODEC_ID_NONE && codec_id != passthrough_codec)
+				return -1;
+
+			bursts += codec_id == passthrough_codec;
+		}
+
+	output_write_callback(output->writable_size());
+	l = do_stream_write_direct(data, send);
+
+	/* Stage only what the stream could not take right now */
+	if(l < send)
+		ringbuffer_write(&outbuffer, data + l, send - l);
+
+	ringbuffer_drop(&inbuffer, send);
+	return bursts;
+}
+
+/* Weighs the bursts found against the ones the length bytes just read should
+ * hold, carrying the remainder in *extra. Returns the number missed, or -1
+ * after switching to silence if too many were */
+static int count_missed_bursts(size_t length, int found, size_t *extra)
+{
+	int missed_frames = (length + *extra) / block_size;
+	*extra += length - (unsigned long)missed_frames * block_size;
+	missed_frames -= found;
+	if (missed_frames < 0)
+	{
+		missed_frames = 0;
+		*extra = 0;
+	}
+
+	total_missed_frames += missed_frames;
+	missed_frames_count += missed_frames;
+	if(!missed_frames)
+		total_missed_frames = 0;
+
+	/* Every burst moves the error rate, a lost one towards 1 */
+	for(int b = 0; b < missed_frames + found; b++)
+		error_rate += ((b < missed_frames) - error_rate) / ERROR_RATE_WINDOW;
+
+	if(error_rate > max_error_rate)
+	{
+		fprintf(stderr, "Too many missed frames\n");
+		total_missed_frames = 0;
+		*extra = 0;
+		fprintf(stderr, "Playing silence\n");
+		set_state(NOSIGNAL);
+		return -1;
+	}
+
+	return missed_frames;
+}
+
+/* Process new data. Called on the decode thread with the mainloop lock held */
+static void decode_data(const void *data, size_t length, void *userdata)
+{
+	int i=0;
+	static size_t prevextralength = 0;
+
+	assert(data);
+	assert(length > 0);
+
+	/* Scanning the data needs nothing the mainloop thread changes, only the
+	 * result is published under the lock. The state only changes here */
+	struct signal_analysis level;
+	pa_sample_spec spec = in_sample_spec;
+	int suspect = 0;
+
+	decoder_unlock();
+	uint64_t t = trace_begin();
+	analyze_signal(data, length, &spec, &level);
+	trace_end("analyze_signal", t);
+	if(state==PCM)
+	{
+		t = trace_begin();
+		suspect = iec61937_suspect(data, length);
+		trace_end("iec61937_suspect", t);
+	}
+	decoder_lock();
+
+	signal_level = level;
+
+	if(state==NOSIGNAL)
+	{
+		if(!signal_level.silent)
+		{
+			/* Skip the leading silence, it is only searched for on this transition */
+			for(i=0; i<length/sizeof(uint32_t); i++)
+				if(((uint32_t*) data)[i])
+					break;
+			set_state(IEC61937);
+		}
+	}
+	else
+	{
+		static pa_usec_t silence=0;
+		if(!signal_level.silent)
+		{
+			silence = 0;
+		}
+		else
+		{
+			silence+=pa_bytes_to_usec(length, &in_sample_spec);
+			if(silence > 100000)
+			{
+				fprintf(stderr, "Playing silence\n");
+				set_state(NOSIGNAL);
+				silence=0;
+				return;
+			}
+		}
+		i=0;
+	}
+
+	if(state==IEC61937)
+	{
+		ringbuffer_write(&inbuffer, (uint32_t*) data + i, length - i*sizeof(uint32_t));
+
+		/* The sink turned the passthrough stream down, lock on again to decode */
+		if(passthrough_codec != AV_CODEC_ID_NONE && !output_open())
+		{
+			passthrough_codec = AV_CODEC_ID_NONE;
+			ringbuffer_clear(&outbuffer);
+			memset(&tracker, 0, sizeof(tracker));
+			block_size = 0;
+		}
+
+		if(passthrough_codec == AV_CODEC_ID_NONE && !avcodeccontext)
+		{
+			t = trace_begin();
+			block_size = iec61937_track(&tracker, ringbuffer_read_ptr(&inbuffer), ringbuffer_length(&inbuffer));
+			trace_end("iec61937_track", t);
+			if (block_size == 0)
+			{
+#ifdef DEBUG_LATENCY
+				fprintf(stderr, "Buffer is too small, waiting for more data\n");
+#endif
+				return;
+			}
+			else if(block_size == 1)
+			{
+				fprintf(stderr, "IEC61937 validation failed\n");
+				set_state(PCM);
+				return;
+			}
+
+#ifdef DEBUG_LATENCY
+			fprintf(stderr, "block_size=%zu\n", block_size);
+#endif
+	
+			enum AVCodecID codec_id = iec61937_peek_codec_id(&inbuffer);
+			struct decoded_format format = {0};
+
+			/* Everything buffered so far is sent or decoded below, count it as arriving now */
+			size_t buffered = ringbuffer_length(&inbuffer) - length;
+
+			/* No avcodec and swr at all if the sink decodes it */
+			if(passthrough_start(codec_id))
+			{
+				set_instream_fragsize(block_size * 2);
+				prevextralength = buffered;
+			}
+			else if(iec61937_peek_format(&inbuffer, &format) == 0 && decoder_cache_take(codec_id, &format))
+				decoder_cache_pending = 1;
+			else
+			{
+				decoder_cache_misses++;
+
+				if(open_decoder(codec_id) < 0)
+				{
+					fprintf(stderr, "Playing silence\n");
+					set_state(NOSIGNAL);
+					return;
+				}
+			}
+
+			if(avcodeccontext)
+			{
+				prevextralength = buffered;
+
+				/* Room for the bursts of one read on top of the ones buffered */
+				ringbuffer_reserve(&inbuffer, block_size * 4);
+
+				packet_slots_setup();
+
+				set_instream_fragsize(block_size * 2);
+			}
+		}
+	}
+
+	/* Raw PCM that follows the bursts without a gap would be sent on as
+	 * IEC61937, the missed bursts end passthrough as they end decoding */
+	if(state==IEC61937 && passthrough_codec != AV_CODEC_ID_NONE)
+	{
+		int bursts = passthrough_forward();
+
+		if(bursts < 0)
+		{
+			fprintf(stderr, "Compressed format changed\n");
+			set_state(NOSIGNAL);
+			return;
+		}
+
+		count_missed_bursts(length, bursts, &prevextralength);
+		return;
+	}
+
+	if(state==IEC61937 && avcodeccontext)
+	{
+		int stream_open = output_open();
+		decoder_unlock();
+		int fcount = decode_bursts(stream_open);
+		decoder_lock();
+
+		if(fcount < 0)
+		{
+			fprintf(stderr, "Playing silence\n");
+			set_state(NOSIGNAL);
+			return;
+		}
+
+		/* decode_bursts() has filled in the lost ones where they were */
+		if(count_missed_bursts(length, fcount, &prevextralength) < 0)
+			return;
+	}
+
+	if(state==PCM)
+	{
+		if(suspect)
+		{
+			fprintf(stderr, "Suspected IEC61937\n");
+			set_state(IEC61937);
+			return;
+		}
+
+		size_t l = 0;
+
+		/* A pinned stream takes PCM converted like decoded audio, and so does an
+		 * output that can only be kept in step by the converter */
+		if(pcm_converted())
+		{
+			pcm_write_converted(data, length);
+			l = length;
+		}
+		else if(output_open())
+		{
+			output_write_callback(output->writable_size());
+			l = do_stream_write_direct(data, length);
+		}
+
+		/* Stage only what the stream could not take right now */
+		if(l < length)
+			ringbuffer_write(&outbuffer, (const uint8_t*) data + l, length - l);
+
+		alloc_steady(output_open());
+	}
+
+	if(output_open())
+		output_write_callback(output->writable_size());
+}
+
+/* This is called whenever new data may is available */
+static void stream_read_callback(pa_stream *s, size_t length, void *userdata)
+{
+	assert(s);
+	assert(length > 0);
+
+	/* The decode thread peeks the data itself */
+	pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+/* New data on STDIN **/
+static void stdin_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+{
+	ssize_t r = 0;
+	size_t l;
 
 	assert(a == mainloop_api);
 	assert(e);
 	assert(stdio_event == e);
 
-	if(!stdin_fragsize)
-		return;
+	if(!stdin_fragsize)
+		return;
+
+	/* Takes all the pipe has into the free space at once, the ring is mirrored
+	 * so it is contiguous across the wrap */
+	while((l = ringbuffer_space(&stdinbuffer)))
+	{
+		uint64_t t = trace_begin();
+		r = read(fd, ringbuffer_write_ptr(&stdinbuffer), l);
+		trace_end("stdin_read", t);
+		if (r <= 0)
+			break;
+
+		ringbuffer_commit(&stdinbuffer, r);
+
+		/* A short read has emptied the pipe */
+		if ((size_t)r < l)
+			break;
+	}
+
+	pa_threaded_mainloop_signal(mainloop, 0);
+
+	if (!l)
+	{
+		/* Full, the decode thread resumes reading once it catches up */
+		mainloop_api->io_enable(stdio_event, PA_IO_EVENT_NULL);
+		stdin_paused = 1;
+	}
+	else if (r == 0)
+	{
+		if (verbose)
+			fprintf(stderr, "Got EOF.\n");
+
+		mainloop_api->io_free(stdio_event);
+		stdio_event = NULL;
+		stdin_eof = 1;
+		return;
+	}
+	else if (r < 0 && errno != EWOULDBLOCK)
+	{
+		fprintf(stderr, "read() failed: %s\n", strerror(errno));
+		quit(1);
+	}
+}
+
+/* Enables or disables all capture poll events */
+static void capture_enable(int enable)
+{
+	int i;
+
+	for (i = 0; i < capture_nfds; i++)
+		mainloop_api->io_enable(capture_events[i], enable ? poll_to_io_flags(capture_fds[i].events) : PA_IO_EVENT_NULL);
+}
+
+/* Captured data is available. The events stay off until the decode thread
+ * has taken it, as they would fire again and again until then */
+static void capture_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+{
+	unsigned short revents = 0;
+	int i;
+
+	for (i = 0; i < capture_nfds; i++)
+		capture_fds[i].revents = capture_events[i] == e ? io_flags_to_poll(f) : 0;
+
+	if (snd_pcm_poll_descriptors_revents(capture, capture_fds, capture_nfds, &revents) < 0 || revents & (POLLIN | POLLERR))
+	{
+		capture_enable(0);
+		capture_pending = 1;
+		pa_threaded_mainloop_signal(mainloop, 0);
+	}
+}
+
+/* Opens the ALSA capture device for mmap access and registers its poll
+ * descriptors with the mainloop. Capturing starts with capture_start() */
+static int capture_open(const char *name)
+{
+	snd_pcm_hw_params_t *hwparams;
+	snd_pcm_sw_params_t *swparams;
+	unsigned int rate = in_sample_spec.rate;
+	int r, i;
+
+	if ((r = snd_pcm_open(&capture, name, SND_PCM_STREAM_CAPTURE, SND_PCM_NONBLOCK)) < 0)
+	{
+		fprintf(stderr, "Cannot open ALSA device %s: %s\n", name, snd_strerror(r));
+		return -1;
+	}
+
+	capture_period = CAPTURE_PERIOD;
+	capture_buffer = CAPTURE_BUFFER;
+
+	snd_pcm_hw_params_alloca(&hwparams);
+	if ((r = snd_pcm_hw_params_any(capture, hwparams)) < 0 ||
+		(r = snd_pcm_hw_params_set_access(capture, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0 ||
+		(r = snd_pcm_hw_params_set_format(capture, hwparams, SND_PCM_FORMAT_S16_LE)) < 0 ||
+		(r = snd_pcm_hw_params_set_channels(capture, hwparams, in_sample_spec.channels)) < 0 ||
+		(r = snd_pcm_hw_params_set_rate_resample(capture, hwparams, 0)) < 0 ||
+		(r = snd_pcm_hw_params_set_rate_near(capture, hwparams, &rate, NULL)) < 0 ||
+		(r = snd_pcm_hw_params_set_period_size_near(capture, hwparams, &capture_period, NULL)) < 0 ||
+		(r = snd_pcm_hw_params_set_buffer_size_near(capture, hwparams, &capture_buffer)) < 0 ||
+		(r = snd_pcm_hw_params(capture, hwparams)) < 0)
+	{
+		fprintf(stderr, "Cannot set up ALSA device %s for S/PDIF capture: %s\n", name, snd_strerror(r));
+		return -1;
+	}
+
+	snd_pcm_hw_params_get_period_size(hwparams, &capture_period, NULL);
+	snd_pcm_hw_params_get_buffer_size(hwparams, &capture_buffer);
+	in_sample_spec.rate = rate;
+
+	snd_pcm_sw_params_alloca(&swparams);
+	if ((r = snd_pcm_sw_params_current(capture, swparams)) < 0 ||
+		(r = snd_pcm_sw_params_set_start_threshold(capture, swparams, 1)) < 0 ||
+		(r = snd_pcm_sw_params(capture, swparams)) < 0)
+	{
+		fprintf(stderr, "Cannot set up ALSA device %s: %s\n", name, snd_strerror(r));
+		return -1;
+	}
+
+	capture_set_fragsize(SILENCE_CHECK_SIZE);
+
+	if ((capture_nfds = snd_pcm_poll_descriptors_count(capture)) <= 0)
+	{
+		fprintf(stderr, "ALSA device %s cannot be polled\n", name);
+		return -1;
+	}
+
+	capture_fds = pa_xmalloc0(capture_nfds * sizeof(*capture_fds));
+	capture_events = pa_xmalloc0(capture_nfds * sizeof(*capture_events));
+	snd_pcm_poll_descriptors(capture, capture_fds, capture_nfds);
+
+	for (i = 0; i < capture_nfds; i++)
+		if (!(capture_events[i] = mainloop_api->io_new(mainloop_api, capture_fds[i].fd, PA_IO_EVENT_NULL, capture_callback, NULL)))
+		{
+			fprintf(stderr, "io_new() failed.\n");
+			return -1;
+		}
+
+	fprintf(stderr, "Capturing from ALSA device %s at %u Hz, period %lu frames, buffer %lu frames\n", name, rate, capture_period, capture_buffer);
+
+	return 0;
+}
+
+static void capture_start(void)
+{
+	int r;
+
+	if ((r = snd_pcm_start(capture)) < 0)
+	{
+		fprintf(stderr, "snd_pcm_start() failed: %s\n", snd_strerror(r));
+		quit(1);
+		return;
+	}
+
+	capture_enable(1);
+}
+
+/* Restarts capturing after an overrun or a suspend */
+static int capture_recover(int err)
+{
+	int r;
+
+	if (err == -EPIPE)
+	{
+		overruns++;
+		if (verbose)
+			fprintf(stderr, "Stream overrun.\n");
+	}
+
+	if ((r = snd_pcm_recover(capture, err, 1)) < 0 || (snd_pcm_state(capture) == SND_PCM_STATE_PREPARED && (r = snd_pcm_start(capture)) < 0))
+	{
+		fprintf(stderr, "ALSA capture failed: %s\n", snd_strerror(r));
+		quit(1);
+		return r;
+	}
+
+	return 0;
+}
+
+/* Hands what has been captured to decode_data() straight from the hardware
+ * buffer, capture_fragsize at a time. Called on the decode thread */
+static void capture_read(void)
+{
+	const snd_pcm_channel_area_t *areas;
+	snd_pcm_uframes_t offset, frames;
+	snd_pcm_sframes_t avail, r;
+	size_t frame_size = pa_frame_size(&in_sample_spec);
+
+	if ((avail = snd_pcm_avail_update(capture)) < 0)
+	{
+		capture_recover(avail);
+		return;
+	}
+
+	while (avail > 0 && !quitting)
+	{
+		frames = capture_fragsize / frame_size;
+		if (frames > (snd_pcm_uframes_t)avail)
+			frames = avail;
+
+		uint64_t t = trace_begin();
+		r = snd_pcm_mmap_begin(capture, &areas, &offset, &frames);
+		trace_end("snd_pcm_mmap_begin", t);
+		if (r < 0)
+		{
+			capture_recover(r);
+			return;
+		}
+
+		/* Interleaved, so the first channel's area is the whole frame */
+		decode_data((const uint8_t *)areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8), frames * frame_size, NULL);
+
+		if ((r = snd_pcm_mmap_commit(capture, offset, frames)) < 0 || (snd_pcm_uframes_t)r != frames)
+		{
+			capture_recover(r < 0 ? r : -EPIPE);
+			return;
+		}
+
+		avail -= frames;
+	}
+}
+
+static void capture_close(void)
+{
+	int i;
+
+	for (i = 0; i < capture_nfds; i++)
+		if (capture_events[i])
+			mainloop_api->io_free(capture_events[i]);
+
+	pa_xfree(capture_events);
+	pa_xfree(capture_fds);
+	capture_events = NULL;
+	capture_fds = NULL;
+	capture_nfds = 0;
+
+	snd_pcm_close(capture);
+	capture = NULL;
+}
+
+/* Maps the capture to replay, it is not read until replay_begin() */
+static int replay_open(const char *path)
+{
+	struct stat st;
+	size_t frame_size = pa_frame_size(&in_sample_spec);
+	void *data;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+	{
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0)
+	{
+		fprintf(stderr, "Cannot stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	/* Whole frames only, or looping would shift the channels */
+	if (!(replay_size = (size_t)st.st_size / frame_size * frame_size))
+	{
+		fprintf(stderr, "%s is empty\n", path);
+		close(fd);
+		return -1;
+	}
+
+	data = mmap(NULL, replay_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Pages read once can go, unless they come around again */
+	madvise(data, replay_size, replay_loops == 1 ? MADV_SEQUENTIAL : MADV_WILLNEED);
+	replay_data = data;
+
+	replay_pos = (size_t)(replay_seek * in_sample_spec.rate) * frame_size;
+	if (replay_pos >= replay_size)
+	{
+		fprintf(stderr, "Cannot seek past the end of %s (%.1f s)\n", path, (double)pa_bytes_to_usec(replay_size, &in_sample_spec) / 1000000);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void replay_timer_callback(pa_mainloop_api *a, pa_time_event *e, const struct timeval *tv, void *userdata)
+{
+	pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+static void replay_begin(void)
+{
+	stdin_fragsize = MAX_STDIN_READ;
+	replay_start = trace_now();
+	replay_fed = 0;
+
+	if (!replay_fast)
+	{
+		struct timeval tv;
+		replay_event = mainloop_api->time_new(mainloop_api, pa_gettimeofday(&tv), replay_timer_callback, NULL);
+	}
+
+	pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+/* Bytes to hand to decode_data() now. In real time a fragment is due once
+ * its last frame would have been captured, until then this returns 0 and
+ * sets the timer to wake the decode thread up */
+static size_t replay_due(void)
+{
+	size_t l = replay_size - replay_pos;
+
+	if (!stdin_fragsize || !replay_data || stdin_eof)
+		return 0;
+
+	if (l > stdin_fragsize)
+		l = stdin_fragsize;
+
+	if (replay_fast)
+		return ringbuffer_length(&outbuffer) + l*out_bytes_per_sample/4 < PA_MAX_BUF ? l : 0;
+
+	uint64_t due = replay_start + pa_bytes_to_usec(replay_fed + l, &in_sample_spec) * 1000;
+	uint64_t now = trace_now();
+	if (now >= due)
+		return l;
+
+	struct timeval tv;
+	mainloop_api->time_restart(replay_event, pa_timeval_add(pa_gettimeofday(&tv), (due - now + 999) / 1000));
+	return 0;
+}
+
+static void replay_advance(size_t l)
+{
+	replay_pos += l;
+	replay_fed += l;
+
+	if (replay_pos < replay_size)
+		return;
+
+	if (replay_loops != 1)
+	{
+		if (replay_loops)
+			replay_loops--;
+		replay_pos = 0;
+		return;
+	}
+
+	if (verbose)
+		fprintf(stderr, "Got EOF.\n");
+	stdin_eof = 1;
+}
+
+static void replay_close(void)
+{
+	if (replay_event)
+		mainloop_api->time_free(replay_event);
+	replay_event = NULL;
+
+	if (replay_data)
+		munmap((void *)replay_data, replay_size);
+	replay_data = NULL;
+}
+
+/* Real-time mode */
+
+/* Gives the calling thread SCHED_FIFO, within RLIMIT_RTPRIO if that is lower */
+static void realtime_thread(const char *name)
+{
+	struct sched_param param = {.sched_priority = REALTIME_PRIORITY};
+	struct rlimit rl;
+	int r;
+
+	if (!getrlimit(RLIMIT_RTPRIO, &rl) && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 0 && rl.rlim_cur < (rlim_t)param.sched_priority)
+		param.sched_priority = rl.rlim_cur;
+
+	if ((r = pthread_setschedparam(pthread_self(), SCHED_FIFO | SCHED_RESET_ON_FORK, &param)))
+		fprintf(stderr, "Cannot make the %s thread real-time: %s (raise RLIMIT_RTPRIO, e.g. LimitRTPRIO= in the service)\n", name, strerror(r));
+	else if (verbose)
+		fprintf(stderr, "Running the %s thread with real-time priority %d\n", name, param.sched_priority);
+}
+
+static void realtime_mainloop_once(pa_mainloop_api *m, void *userdata)
+{
+	realtime_thread("mainloop");
+}
+
+static void realtime_lock_memory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0)
+		fprintf(stderr, "mlockall() failed: %s (raise RLIMIT_MEMLOCK, e.g. LimitMEMLOCK= in the service)\n", strerror(errno));
+}
+
+/* Touches the stack the decode thread may need, so that is not faulted in
+ * in the middle of a burst either */
+static void realtime_prefault_stack(void)
+{
+	volatile uint8_t stack[REALTIME_STACK];
+	size_t i, pagesize = sysconf(_SC_PAGESIZE);
+
+	for (i = 0; i < sizeof(stack); i += pagesize)
+		stack[i] = 0;
+}
+
+/* How late the decode thread wakes up from a sleep, in usec */
+static void realtime_measure_jitter(void)
+{
+	struct timespec ts;
+	uint64_t next = trace_now(), late, sum = 0, max = 0;
+	int i;
+
+	for (i = 0; i < JITTER_PROBES; i++)
+	{
+		next += JITTER_PERIOD;
+		ts.tv_sec = next / 1000000000;
+		ts.tv_nsec = next % 1000000000;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+
+		late = trace_now() - next;
+		sum += late;
+		if (late > max)
+			max = late;
+	}
+
+	jitter_avg = sum / 1000.0 / JITTER_PROBES;
+	jitter_max = max / 1000.0;
+}
+
+static void print_realtime_stats(void)
+{
+	struct rusage ru;
+
+	fprintf(stderr, "Scheduling jitter %.1f usec average, %.1f usec max", jitter_avg, jitter_max);
+	if (latency_event)
+		fprintf(stderr, ", mainloop timers up to %zu usec late", (size_t)timer_late_max);
+	fprintf(stderr, "\n");
+
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(stderr, "Page faults: %ld minor, %ld major\n", ru.ru_minflt, ru.ru_majflt);
+}
+
+/* Decode thread: takes input from the record stream, the ALSA capture device
+ * or stdinbuffer, or the replayed file, and sleeps on the mainloop condition
+ * when there is nothing to do */
+static void *decode_thread_main(void *userdata)
+{
+	const void *data;
+	size_t length;
+
+	pthread_setname_np(pthread_self(), "decode");
+	if (allocwatch_thread)
+		allocwatch_thread();
+
+	if (realtime)
+	{
+		realtime_thread("decode");
+		realtime_prefault_stack();
+		realtime_measure_jitter();
+		print_realtime_stats();
+	}
+
+	pa_threaded_mainloop_lock(mainloop);
+
+	while (!quitting)
+	{
+		if (instream && pa_stream_get_state(instream) == PA_STREAM_READY && pa_stream_readable_size(instream) > 0)
+		{
+			uint64_t t = trace_begin();
+			int r = pa_stream_peek(instream, &data, &length);
+			trace_end("pa_stream_peek", t);
+			if (r < 0)
+			{
+				fprintf(stderr, "pa_stream_peek() failed: %s\n", pa_strerror(pa_context_errno(context)));
+				quit(1);
+				break;
+			}
+
+			/* data is NULL if there is a hole in the stream */
+			if (data && length)
+				decode_data(data, length, userdata);
+
+			if (length)
+				pa_stream_drop(instream);
+		}
+		else if (capture && capture_pending)
+		{
+			capture_pending = 0;
+			capture_read();
+			if (capture)
+				capture_enable(1);
+		}
+		else if (stdin_fragsize && ringbuffer_length(&stdinbuffer) && ringbuffer_length(&outbuffer) + stdin_fragsize*out_bytes_per_sample/4 < PA_MAX_BUF)
+		{
+			/* Everything read so far in one pass, still no more than the
+			 * input latency worth of it per decode_data() call */
+			size_t left = ringbuffer_length(&stdinbuffer);
+
+			while (left && !quitting && stdin_fragsize && ringbuffer_length(&outbuffer) + stdin_fragsize*out_bytes_per_sample/4 < PA_MAX_BUF)
+			{
+				length = left < stdin_fragsize ? left : stdin_fragsize;
+
+				decode_data(ringbuffer_read_ptr(&stdinbuffer), length, userdata);
+				ringbuffer_drop(&stdinbuffer, length);
+				left -= length;
+			}
 
-	while(outbuffer_index + outbuffer_length + stdin_fragsize*out_bytes_per_sample/4 < PA_MAX_BUF && (r = read(fd, &buf, stdin_fragsize)) > 0)
-	{
-		decode_data(buf, r, userdata);
+			if (stdin_paused && stdio_event)
+			{
+				mainloop_api->io_enable(stdio_event, PA_IO_EVENT_INPUT);
+				stdin_paused = 0;
+			}
+		}
+		else if ((length = replay_due()))
+		{
+			decode_data(replay_data + replay_pos, length, userdata);
+			replay_advance(length);
+		}
+		else if (stdin_eof && !input_done && !ringbuffer_length(&stdinbuffer))
+		{
+			input_done = 1;
+			output->drain();
+		}
+		else
+			pa_threaded_mainloop_wait(mainloop);
 	}
 
-	if (r == 0)
-	{
-		if (verbose)
-			fprintf(stderr, "Got EOF.\n");
+	pa_threaded_mainloop_unlock(mainloop);
 
-		mainloop_api->io_free(stdio_event);
-		stdio_event = NULL;
-		start_drain(outstream);
-		return;
-	}
-	else if (r < 0 && errno != EWOULDBLOCK)
-	{
-		fprintf(stderr, "read() failed: %s\n", strerror(errno));
-		quit(1);
-	}
+	return NULL;
 }
 
 /* This is called whenever the context status changes */
@@ -1141,6 +5010,19 @@ static void context_state_callback(pa_context *c, void *userdata)
 			if (stdio_event)
 			{
 				stdin_fragsize = MAX_STDIN_READ;
+				pa_threaded_mainloop_signal(mainloop, 0);
+				break;
+			}
+
+			if (capture)
+			{
+				capture_start();
+				break;
+			}
+
+			if (replay_data)
+			{
+				replay_begin();
 				break;
 			}
 
@@ -1205,6 +5087,126 @@ static void exit_signal_callback(pa_mainloop_api *m, pa_signal_event *e, int sig
 	quit(0);
 }
 
+static void metrics_stream_latency(FILE *f, const char *name, pa_stream *s)
+{
+	pa_usec_t latency;
+	int negative;
+
+	if (s && pa_stream_get_state(s) == PA_STREAM_READY && !pa_stream_get_latency(s, &latency, &negative))
+		fprintf(f, "pareceive_%s_stream_latency_seconds %s%f\n", name, negative ? "-" : "", latency / 1e6);
+}
+
+/* Writes all metrics in the Prometheus text exposition format */
+static void metrics_write(FILE *f)
+{
+	static const char *state_names[] = {"nosignal", "pcm", "iec61937"};
+	unsigned i;
+
+	fprintf(f, "# TYPE pareceive_state gauge\n");
+	for (i = 0; i < sizeof(state_names) / sizeof(*state_names); i++)
+		fprintf(f, "pareceive_state{state=\"%s\"} %d\n", state_names[i], state == i);
+
+	fprintf(f, "# TYPE pareceive_input_stream_latency_seconds gauge\n");
+	metrics_stream_latency(f, "input", instream);
+	fprintf(f, "# TYPE pareceive_output_stream_latency_seconds gauge\n");
+	metrics_stream_latency(f, "output", outstream);
+
+	fprintf(f, "# TYPE pareceive_inbuffer_bytes gauge\npareceive_inbuffer_bytes %zu\n", ringbuffer_length(&inbuffer));
+	fprintf(f, "# TYPE pareceive_outbuffer_bytes gauge\npareceive_outbuffer_bytes %zu\n", ringbuffer_length(&outbuffer));
+	fprintf(f, "# TYPE pareceive_output_latency_seconds gauge\npareceive_output_latency_seconds %f\n", measured_latency / 1e6);
+	fprintf(f, "# TYPE pareceive_output_latency_target_seconds gauge\npareceive_output_latency_target_seconds %f\n", locked_latency / 1e6);
+	fprintf(f, "# TYPE pareceive_clock_drift_ppm gauge\npareceive_clock_drift_ppm %f\n", drift_ppm);
+	fprintf(f, "# TYPE pareceive_rate_correction_ppm gauge\npareceive_rate_correction_ppm %f\n", correction_ppm);
+
+	fprintf(f, "# TYPE pareceive_underruns_total counter\npareceive_underruns_total %lu\n", underruns);
+	fprintf(f, "# TYPE pareceive_overruns_total counter\npareceive_overruns_total %lu\n", overruns);
+	fprintf(f, "# TYPE pareceive_dropped_bytes_total counter\npareceive_dropped_bytes_total %zu\n", dropped_bytes);
+	fprintf(f, "# TYPE pareceive_missed_frames_total counter\npareceive_missed_frames_total %lu\n", missed_frames_count);
+	fprintf(f, "# TYPE pareceive_missed_frames gauge\npareceive_missed_frames %d\n", total_missed_frames);
+	fprintf(f, "# TYPE pareceive_concealed_frames_total counter\npareceive_concealed_frames_total %lu\n", concealed_frames);
+	fprintf(f, "# TYPE pareceive_frame_error_rate gauge\npareceive_frame_error_rate %f\n", error_rate);
+	fprintf(f, "# TYPE pareceive_state_transitions_total counter\npareceive_state_transitions_total %lu\n", state_transitions);
+	fprintf(f, "# TYPE pareceive_decoder_opens_total counter\npareceive_decoder_opens_total %lu\n", decoder_opens);
+	fprintf(f, "# TYPE pareceive_decoder_cache_hits_total counter\npareceive_decoder_cache_hits_total %lu\n", decoder_cache_hits);
+	fprintf(f, "# TYPE pareceive_decoder_cache_misses_total counter\npareceive_decoder_cache_misses_total %lu\n", decoder_cache_misses);
+
+	struct rusage ru;
+	if (!getrusage(RUSAGE_SELF, &ru))
+		fprintf(f, "# TYPE pareceive_page_faults_total counter\npareceive_page_faults_total{type=\"minor\"} %ld\npareceive_page_faults_total{type=\"major\"} %ld\n", ru.ru_minflt, ru.ru_majflt);
+}
+
+/* A client connected to the metrics socket. Answers with a minimal HTTP
+ * response so both curl --unix-socket and a plain nc work */
+static void metrics_accept_callback(pa_mainloop_api *a, pa_io_event *e, int fd, pa_io_event_flags_t f, void *userdata)
+{
+	char request[1024];
+	char *body = NULL, *response = NULL;
+	size_t body_length = 0;
+	int client, l;
+
+	if ((client = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+		return;
+
+	/* The request itself does not matter, take whatever has arrived */
+	if (read(client, request, sizeof(request)) < 0 && errno != EAGAIN)
+		goto out;
+
+	FILE *m = open_memstream(&body, &body_length);
+	if (!m)
+		goto out;
+	metrics_write(m);
+	fclose(m);
+
+	if ((l = asprintf(&response, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n%s", body_length, body)) > 0)
+	{
+		if (write(client, response, l) != l && verbose)
+			fprintf(stderr, "Short write on the metrics socket\n");
+	}
+
+out:
+	free(response);
+	free(body);
+	close(client);
+}
+
+static int metrics_listen(const char *path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Metrics socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	if ((metrics_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0)
+	{
+		fprintf(stderr, "socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(metrics_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(metrics_fd, 8) < 0)
+	{
+		fprintf(stderr, "Metrics socket %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	if (!(metrics_event = mainloop_api->io_new(mainloop_api, metrics_fd, PA_IO_EVENT_INPUT, metrics_accept_callback, NULL)))
+	{
+		fprintf(stderr, "io_new() failed.\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void sigusr2_signal_callback(pa_mainloop_api *m, pa_signal_event *e, int sig, void *userdata)
+{
+	trace_dump(trace_path);
+}
+
 static void sigusr1_signal_callback(pa_mainloop_api *m, pa_signal_event *e, int sig, void *userdata)
 {
 	pa_operation *o;
@@ -1220,6 +5222,13 @@ static void sigusr1_signal_callback(pa_mainloop_api *m, pa_signal_event *e, int
 
 		pa_operation_unref(o);
 	}
+	else if(capture)
+	{
+		snd_pcm_sframes_t delay;
+
+		if(!snd_pcm_delay(capture, &delay))
+			fprintf(stderr, "Input stream latency %zu usec\n", (size_t)pa_bytes_to_usec((uint64_t)delay * pa_frame_size(&in_sample_spec), &in_sample_spec));
+	}
 	else
 	{
 		fprintf(stderr, "Input stream latency %zu usec\n", (size_t)pa_bytes_to_usec(stdin_fragsize, &in_sample_spec));
@@ -1236,56 +5245,494 @@ static void sigusr1_signal_callback(pa_mainloop_api *m, pa_signal_event *e, int
 
 		pa_operation_unref(o);
 	}
+	else if(playback && !output_direct_write)
+	{
+		snd_pcm_sframes_t delay;
+
+		if(!snd_pcm_delay(playback, &delay))
+			fprintf(stderr, "Output stream latency %zu usec\n", (size_t)pa_bytes_to_usec((uint64_t)delay * playback_frame_size, &out_sample_spec));
+	}
 
 	if(verbose)
 	{
-		fprintf(stderr, "Input buffer %zu usec\n", (size_t)pa_bytes_to_usec(inbuffer_length, &in_sample_spec));
-		fprintf(stderr, "Output buffer %zu usec\n", (size_t)(outstream?pa_bytes_to_usec(outbuffer_length, &out_sample_spec):0));
+		fprintf(stderr, "Input buffer %zu usec\n", (size_t)pa_bytes_to_usec(ringbuffer_length(&inbuffer), &in_sample_spec));
+		fprintf(stderr, "Output buffer %zu usec\n", (size_t)(output_open()?pa_bytes_to_usec(ringbuffer_length(&outbuffer), &out_sample_spec):0));
+		if(realtime)
+			print_realtime_stats();
+		if(latency_event)
+			fprintf(stderr, "Output latency %.0f usec, target %zu usec, clock drift %.1f ppm, correction %.1f ppm, dropped %zu bytes\n", measured_latency, (size_t)locked_latency, drift_ppm, correction_ppm, dropped_bytes);
+
+		unsigned c;
+		for(c = 0; c < signal_level.channels; c++)
+		{
+			double rms = signal_level.frames ? sqrt((double)signal_level.sumsq[c] / signal_level.frames) : 0;
+			fprintf(stderr, "Input channel %u level: peak %.1f dBFS, RMS %.1f dBFS, DC offset %.1f\n", c,
+					20 * log10((signal_level.peak[c] + 1e-9) / 32768), 20 * log10((rms + 1e-9) / 32768),
+					signal_level.frames ? (double)signal_level.sum[c] / signal_level.frames : 0);
+		}
+		fprintf(stderr, "Decoder cache: %lu hits, %lu misses\n", decoder_cache_hits, decoder_cache_misses);
+
+		if(signal_level.dc && !signal_level.zero)
+			fprintf(stderr, "Input carries DC only, treating it as silence\n");
+	}
+}
+
+static double monotonic_seconds(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* User plus system time of all threads, decoder threads included */
+static double cpu_seconds(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		return 0;
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/* The byte-at-a-time search the vector kernels replaced, kept as the benchmark
+ * baseline: the loop iec61937_validate() and iec61937_suspect() used to run */
+static size_t iec61937_find_sync_bytewise(const uint8_t *data, size_t length)
+{
+	static const uint32_t magic = 0x4E1FF872;
+	size_t i;
+
+	for(i = 0; i + sizeof(uint32_t) <= length; i++)
+		if(*(uint32_t*)(data+i) == magic)
+			return i;
+
+	return length;
+}
+
+static size_t count_syncs(size_t (*find)(const uint8_t*, size_t), const uint8_t *data, size_t length)
+{
+	size_t n = 0, i = 0;
+
+	while((i += find(data + i, length - i)) < length)
+	{
+		n++;
+		i++;
+	}
+
+	return n;
+}
+
+/* Measures the sync word search throughput of both implementations, in MB/s */
+static double bench_find_sync(size_t (*find)(const uint8_t*, size_t), const uint8_t *data, size_t length)
+{
+	double start = monotonic_seconds(), elapsed;
+	size_t runs = 0;
+
+	do
+	{
+		count_syncs(find, data, length);
+		runs++;
+	} while((elapsed = monotonic_seconds() - start) < 0.5);
+
+	return runs * length / elapsed / 1e6;
+}
+
+/* Reads a whole test vector into memory, - is stdin */
+static uint8_t *bench_load(const char *path, size_t *length)
+{
+	FILE *f = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	uint8_t *data = NULL;
+	size_t alloc = 0, r;
+
+	if(!f)
+	{
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+
+	*length = 0;
+	do
+	{
+		if(*length == alloc)
+		{
+			alloc = alloc ? alloc * 2 : 1024 * 1024;
+			data = pa_xrealloc(data, alloc);
+		}
+		*length += r = fread(data + *length, 1, alloc - *length, f);
+	} while(r);
+
+	if(ferror(f))
+	{
+		fprintf(stderr, "%s: read error\n", path);
+		pa_xfree(data);
+		data = NULL;
+	}
+
+	if(f != stdin)
+		fclose(f);
+
+	return data;
+}
+
+/* Micro-benchmark of the IEC61937 sync word search over capture files */
+static int bench_sync(int count, char *files[])
+{
+	int i;
+
+	for(i = 0; i < count; i++)
+	{
+		uint8_t *data;
+		size_t length;
+
+		if(!(data = bench_load(files[i], &length)))
+			return 1;
+
+		size_t syncs = count_syncs(iec61937_find_sync, data, length);
+		if(syncs != count_syncs(iec61937_find_sync_bytewise, data, length))
+		{
+			fprintf(stderr, "%s: sync word search results differ\n", files[i]);
+			pa_xfree(data);
+			return 1;
+		}
+
+		double bytewise = bench_find_sync(iec61937_find_sync_bytewise, data, length);
+		double vector = bench_find_sync(iec61937_find_sync, data, length);
+		printf("%s: %zu sync words, bytewise %.1f MB/s, vector %.1f MB/s (x%.1f)\n", files[i], syncs, bytewise, vector, vector / bytewise);
+
+		pa_xfree(data);
+	}
+
+	return 0;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_usec(const uint64_t *sorted, size_t count, double p)
+{
+	return count ? sorted[(size_t)(p * (count - 1) + 0.5)] / 1e3 : 0;
+}
+
+/* Feeds a test vector through analysis, lock-on, parsing, decoding and
+ * conversion exactly as stdin input is, with the output discarded */
+static int bench_pipeline(int count, char *files[])
+{
+	int i, ret = 0;
+
+	offline = 1;
+	verbose = 0;
+	output = &null_output;
+	null_fast = 1;
+	if (allocwatch_thread)
+		allocwatch_thread();
+
+	for(i = 0; i < count; i++)
+	{
+		uint8_t *data;
+		size_t length, offset = 0;
+
+		if(!(data = bench_load(files[i], &length)))
+			return 1;
+
+		stdin_fragsize = MAX_STDIN_READ;
+		bench_burst_count = 0;
+		/* A burst every 384 frames at most (MPEG-1 layer 1), so that recording does not allocate */
+		bench_reserve_bursts(length / (384 * 4) + 1);
+
+		unsigned long allocations_start = allocwatch_allocations ? allocwatch_allocations() : 0;
+		unsigned long steady_start = allocwatch_steady_allocations ? allocwatch_steady_allocations() : 0;
+		unsigned long decoder_start = allocwatch_decoder_allocations ? allocwatch_decoder_allocations() : 0;
+		uint64_t out_start = sink_bytes;
+		double start = monotonic_seconds(), cpu_start = cpu_seconds();
+		const char *codec = "none";
+		int threads = 1;
+
+		while(offset < length)
+		{
+			size_t l = length - offset < stdin_fragsize ? length - offset : stdin_fragsize;
+			decode_data(data + offset, l, NULL);
+			offset += l;
+
+			if(state == IEC61937 && avcodeccontext)
+			{
+				codec = avcodeccontext->codec->name;
+				threads = avcodeccontext->active_thread_type ? avcodeccontext->thread_count : 1;
+			}
+			else if(state == PCM && !strcmp(codec, "none"))
+				codec = "pcm";
+		}
+
+		/* Start the next vector cold, like a freshly started receiver */
+		set_state(NOSIGNAL);
+		decoder_cache_free();
+
+		double elapsed = monotonic_seconds() - start, cpu = cpu_seconds() - cpu_start;
+		unsigned long allocs = allocwatch_allocations ? allocwatch_allocations() - allocations_start : 0;
+		unsigned long steady = allocwatch_steady_allocations ? allocwatch_steady_allocations() - steady_start : 0;
+		unsigned long decoder = allocwatch_decoder_allocations ? allocwatch_decoder_allocations() - decoder_start : 0;
+		double duration = (double)pa_bytes_to_usec(length, &in_sample_spec) / 1e6;
+
+		qsort(bench_burst_times, bench_burst_count, sizeof(*bench_burst_times), compare_u64);
+
+		printf("%s: %s, %d thread%s, %.1f MB/s, x%.0f real time, %.2f%% CPU in real time, %zu bursts, decode p50 %.1f p90 %.1f p99 %.1f max %.1f usec, ",
+				files[i], codec, threads, threads == 1 ? "" : "s", length / elapsed / 1e6, duration / elapsed,
+				duration ? cpu / duration * 100 : 0, bench_burst_count,
+				percentile_usec(bench_burst_times, bench_burst_count, 0.5),
+				percentile_usec(bench_burst_times, bench_burst_count, 0.9),
+				percentile_usec(bench_burst_times, bench_burst_count, 0.99),
+				percentile_usec(bench_burst_times, bench_burst_count, 1));
+		/* Allocations are only counted with the allocation watch preloaded */
+		if(allocwatch_allocations)
+			printf("%.0f allocations/s, ", allocs / elapsed);
+		/* What FFmpeg still allocates per burst, packet slots or not */
+		if(allocwatch_decoder_allocations && bench_burst_count)
+			printf("%.1f decoder allocations/burst, ", (double)decoder / bench_burst_count);
+		printf("%zu bytes out\n", (size_t)(sink_bytes - out_start));
+
+		pa_xfree(data);
+
+		/* Setup may allocate, a playing stream must not */
+		if(steady)
+		{
+			fprintf(stderr, "%s: %lu allocations after lock-on\n", files[i], steady);
+			ret = 1;
+		}
 	}
+
+	pa_xfree(bench_burst_times);
+	sink_free();
+
+	return ret;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [options] [indevice [outdevice [server]]]\nTo use stdin as input, use - as indevice\nTo capture straight from an ALSA device, use alsa:NAME as indevice, e.g. alsa:hw:CARD=SPDIF\n"
+			"To replay a capture in real time, use file:PATH as indevice\n"
+			"outdevice may also be null: (discard in real time), null:fast (discard as it comes),\n"
+			"- (raw samples to stdout), file:PATH (raw, or WAV if PATH ends with .wav), wav:PATH or alsa:NAME\n"
+			"  -l, --latency=MSEC   output latency to hold against clock drift (default: as found after start)\n"
+			"  -p, --period=USEC    ALSA output period (default: 1000)\n"
+			"  -b, --buffer=USEC    ALSA output buffer (default: 4000)\n"
+			"      --threads=N      decoder threads, 0 for one per CPU (default: 1)\n"
+			"      --thread-type=TYPE  slice, frame or any, frame threads are capped by the latency (default: slice)\n"
+			"      --pin[=MAP][@RATE]  convert everything to one float32 output stream that is never\n"
+			"                       reopened, MAP is a PulseAudio channel map (default: surround-71@48000)\n"
+			"      --passthrough    send compressed formats the sink takes to it undecoded\n"
+			"      --max-error-rate=PERCENT  lost bursts are played as silence until this share of\n"
+			"                       them, sustained, starts the lock-on over (default: 50)\n"
+			"      --fast           replay the file as fast as it is decoded\n"
+			"      --loop[=COUNT]   replay the file COUNT times (default: forever)\n"
+			"      --seek=SEC       start replaying the file SEC seconds in\n"
+			"  -r, --realtime       real-time priority for the audio threads, locked and prefaulted memory\n"
+			"  -m, --metrics=PATH   serve Prometheus metrics on a Unix socket\n"
+			"  -t, --trace=FILE     record pipeline stage timings, written as Chrome trace JSON on SIGUSR2 and exit\n"
+			"  -h, --help           show this help\n"
+			"  -v, --version        show the version\n"
+			"       %s [options] --bench file...\nRuns the decoding pipeline on captured files (- for stdin) without an audio server\n"
+			"       %s --bench-sync file...\nMeasures the IEC61937 sync word search speed on captured files\n", name, name, name);
 }
 
 int main(int argc, char *argv[])
 {
-	pa_mainloop* m = NULL;
-	int ret = 1, r;
+	int ret = 1, r, thread_started = 0, c, bench = 0;
 	char *server = NULL;
 	unsigned long type = 0;
 
-	if((argc > 1 && (!strcmp(argv[1], "--help") || !strcmp(argv[1], "-h"))) || argc > 4)
+	static const struct option options[] =
 	{
-		printf("Usage: %s [indevice [outdevice [server]]]\nTo use stdin as input, use - as indevice\n", argv[0]);
-		return 0;
-	}
-
-	if(argc > 1 && (!strcmp(argv[1], "--version") || !strcmp(argv[1], "-v")))
+		{"latency", required_argument, NULL, 'l'},
+		{"period", required_argument, NULL, 'p'},
+		{"buffer", required_argument, NULL, 'b'},
+		{"realtime", no_argument, NULL, 'r'},
+		{"threads", required_argument, NULL, 'T'},
+		{"thread-type", required_argument, NULL, 'Y'},
+		{"pin", optional_argument, NULL, 'P'},
+		{"passthrough", no_argument, NULL, 'X'},
+		{"max-error-rate", required_argument, NULL, 'E'},
+		{"fast", no_argument, NULL, 'F'},
+		{"loop", optional_argument, NULL, 'L'},
+		{"seek", required_argument, NULL, 'S'},
+		{"metrics", required_argument, NULL, 'm'},
+		{"trace", required_argument, NULL, 't'},
+		{"help", no_argument, NULL, 'h'},
+		{"version", no_argument, NULL, 'v'},
+		{"bench", no_argument, NULL, 'B'},
+		{"bench-sync", no_argument, NULL, 'Z'},
+		{NULL, 0, NULL, 0}
+	};
+
+	while((c = getopt_long(argc, argv, "l:p:b:rm:t:hv", options, NULL)) != -1)
 	{
+		switch(c)
+		{
+			case 'l':
+				target_latency = (pa_usec_t)strtoul(optarg, NULL, 10) * 1000;
+				if(!target_latency)
+				{
+					fprintf(stderr, "Invalid latency: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'p':
+			case 'b':
+				if(!(r = strtoul(optarg, NULL, 10)))
+				{
+					fprintf(stderr, "Invalid ALSA %s: %s\n", c == 'p' ? "period" : "buffer", optarg);
+					return 1;
+				}
+				if(c == 'p')
+					playback_period_usec = r;
+				else
+					playback_buffer_usec = r;
+				break;
+			case 'r':
+				realtime = 1;
+				break;
+			case 'T':
+				decoder_threads = strtol(optarg, NULL, 10);
+				if(decoder_threads < 0)
+				{
+					fprintf(stderr, "Invalid decoder threads: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'Y':
+				if(!strcmp(optarg, "frame"))
+					decoder_thread_type = FF_THREAD_FRAME;
+				else if(!strcmp(optarg, "slice"))
+					decoder_thread_type = FF_THREAD_SLICE;
+				else if(!strcmp(optarg, "any"))
+					decoder_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+				else
+				{
+					fprintf(stderr, "Invalid decoder thread type: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'B':
+			case 'Z':
+				bench = c;
+				break;
+			case 'P':
+				if(pin_parse(optarg) < 0)
+					return 1;
+				break;
+			case 'X':
+				passthrough = 1;
+				break;
+			case 'E':
+				max_error_rate = strtod(optarg, NULL) / 100;
+				if(max_error_rate <= 0 || max_error_rate >= 1)
+				{
+					fprintf(stderr, "Invalid error rate: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'F':
+				replay_fast = 1;
+				break;
+			case 'L':
+				replay_loops = optarg ? strtoul(optarg, NULL, 10) : 0;
+				break;
+			case 'S':
+				if((replay_seek = strtod(optarg, NULL)) < 0)
+				{
+					fprintf(stderr, "Invalid seek: %s\n", optarg);
+					return 1;
+				}
+				break;
+			case 'm':
+				metrics_path = optarg;
+				break;
+			case 't':
+				trace_path = optarg;
+				trace_epoch = trace_now();
+				tracing = 1;
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			case 'v':
 #ifndef _GIT_REV
 #define _GIT_REV "unknown"
 #endif
-		printf("%s rev. %s\n", argv[0], _GIT_REV);
-		return 0;
+				printf("%s rev. %s\n", argv[0], _GIT_REV);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if(bench == 'Z')
+		return bench_sync(argc - optind, argv + optind);
+
+	if(bench)
+	{
+		avframe = av_frame_alloc();
+		pkt = av_packet_alloc();
+		ringbuffer_reserve(&inbuffer, SPDIF_MAX_OFFSET * 2 + MAX_STDIN_READ);
+		ringbuffer_reserve(&outbuffer, MAX_STDIN_READ * 4);
+
+		ret = bench_pipeline(argc - optind, argv + optind);
+
+		av_packet_free(&pkt);
+		av_frame_free(&avframe);
+		packet_slots_free();
+		arena_free(&stream_arena);
+		ringbuffer_free(&inbuffer);
+		ringbuffer_free(&outbuffer);
+		return ret;
+	}
+
+	if(argc - optind > 3)
+	{
+		usage(argv[0]);
+		return 1;
 	}
 
-	if(argc > 1)
-		indevice = argv[1];
+	if(argc > optind)
+		indevice = argv[optind];
+
+	if(argc > optind + 1)
+		outdevice = argv[optind + 1];
 
-	if(argc > 2)
-		outdevice = argv[2];
+	if(argc > optind + 2)
+		server = argv[optind + 2];
 
-	if(argc > 3)
-		server = argv[3];
+	output = output_select(outdevice);
+
+	if(passthrough && (pinned || !output->open_passthrough))
+	{
+		fprintf(stderr, "Passthrough needs a PulseAudio sink and no --pin\n");
+		return 1;
+	}
 
 	avframe = av_frame_alloc();
 	pkt = av_packet_alloc();
 
-	/* Set up a new main loop */
-	if (!(m = pa_mainloop_new()))
+	if (realtime)
+		realtime_lock_memory();
+
+	/* Enough to hold the IEC61937 lock-on window plus one read */
+	ringbuffer_reserve(&inbuffer, SPDIF_MAX_OFFSET * 2 + MAX_STDIN_READ);
+	ringbuffer_reserve(&outbuffer, MAX_STDIN_READ * 4);
+
+	/* Set up a new main loop, it runs in its own thread next to the decode thread */
+	if (!(mainloop = pa_threaded_mainloop_new()))
 	{
-		fprintf(stderr, "pa_mainloop_new() failed.\n");
+		fprintf(stderr, "pa_threaded_mainloop_new() failed.\n");
 		goto quit;
 	}
 
-	mainloop_api = pa_mainloop_get_api(m);
+	mainloop_api = pa_threaded_mainloop_get_api(mainloop);
+
+	if (realtime)
+		pa_mainloop_api_once(mainloop_api, realtime_mainloop_once, NULL);
 
 	r = pa_signal_init(mainloop_api);
 	assert(r == 0);
@@ -1294,6 +5741,10 @@ int main(int argc, char *argv[])
 #ifdef SIGUSR1
 	pa_signal_new(SIGUSR1, sigusr1_signal_callback, NULL);
 #endif
+#ifdef SIGUSR2
+	if (trace_path)
+		pa_signal_new(SIGUSR2, sigusr2_signal_callback, NULL);
+#endif
 #ifdef SIGPIPE
 	signal(SIGPIPE, SIG_IGN);
 #endif
@@ -1305,41 +5756,100 @@ int main(int argc, char *argv[])
 			fprintf(stderr, "fcntl: %s\n", strerror(errno));
 			goto quit;
 		}
+#ifdef F_SETPIPE_SZ
+		/* A deeper pipe lets the writer run ahead while decoding takes the
+		 * lock, and then gets read in fewer calls. Not a pipe or over
+		 * /proc/sys/fs/pipe-max-size is fine, the default size works too */
+		fcntl(STDIN_FILENO, F_SETPIPE_SZ, STDIN_PIPE_SIZE);
+#endif
+		ringbuffer_reserve(&stdinbuffer, STDIN_BUFFER_SIZE);
 		if (!(stdio_event = mainloop_api->io_new(mainloop_api, STDIN_FILENO, PA_IO_EVENT_INPUT, stdin_callback, &type)))
 		{
 			fprintf(stderr, "io_new() failed.\n");
 			goto quit;
 		}
 	}
-
-	/* Create a new connection context */
-	if (!(context = pa_context_new(mainloop_api, "pareceive")))
+	else if (indevice && !strncmp(indevice, "alsa:", 5))
 	{
-		fprintf(stderr, "pa_context_new() failed.\n");
-		goto quit;
+		if (capture_open(indevice + 5) < 0)
+			goto quit;
+	}
+	else if (indevice && !strncmp(indevice, "file:", 5))
+	{
+		if (replay_open(indevice + 5) < 0)
+			goto quit;
 	}
 
-	pa_context_set_state_callback(context, context_state_callback, NULL);
+	if (metrics_path && metrics_listen(metrics_path) < 0)
+		goto quit;
+
+	/* Every live input is steered, stdin from arecord as well */
+	struct timeval tv;
+	latency_event = mainloop_api->time_new(mainloop_api, pa_timeval_add(pa_gettimeofday(&tv), LATENCY_CONTROL_INTERVAL), latency_control_callback, NULL);
+
+	/* Reading stdin, ALSA or a file into a file or null output needs no server */
+	if (stdio_event && output != &pulse_output)
+		stdin_fragsize = MAX_STDIN_READ;
+	else if (capture && output != &pulse_output)
+		capture_start();
+	else if (replay_data && output != &pulse_output)
+		replay_begin();
+	else
+	{
+		/* Create a new connection context */
+		if (!(context = pa_context_new(mainloop_api, "pareceive")))
+		{
+			fprintf(stderr, "pa_context_new() failed.\n");
+			goto quit;
+		}
+
+		pa_context_set_state_callback(context, context_state_callback, NULL);
+
+		/* Connect the context */
+		if (pa_context_connect(context, server, PA_CONTEXT_NOFLAGS, NULL) < 0)
+		{
+			fprintf(stderr, "pa_context_connect() failed: %s\n", pa_strerror(pa_context_errno(context)));
+			goto quit;
+		}
+	}
 
-	/* Connect the context */
-	if (pa_context_connect(context, server, PA_CONTEXT_NOFLAGS, NULL) < 0)
+	if ((r = pthread_create(&decode_thread, NULL, decode_thread_main, &type)))
 	{
-		fprintf(stderr, "pa_context_connect() failed: %s\n", pa_strerror(pa_context_errno(context)));
+		fprintf(stderr, "pthread_create() failed: %s\n", strerror(r));
 		goto quit;
 	}
+	thread_started = 1;
 
 	/* Run the main loop */
-	if (pa_mainloop_run(m, &ret) < 0)
+	pa_threaded_mainloop_lock(mainloop);
+	if (pa_threaded_mainloop_start(mainloop) < 0)
 	{
-		fprintf(stderr, "pa_mainloop_run() failed.\n");
-		goto quit;
+		fprintf(stderr, "pa_threaded_mainloop_start() failed.\n");
+		quit(1);
 	}
+	while (!quitting)
+		pa_threaded_mainloop_wait(mainloop);
+	pa_threaded_mainloop_unlock(mainloop);
+
+	ret = quit_ret;
 
 quit:
+	if (thread_started)
+		pthread_join(decode_thread, NULL);
+
+	if (mainloop)
+		pa_threaded_mainloop_stop(mainloop);
+
 	av_packet_free(&pkt);
 	av_frame_free(&avframe);
 
 	set_state(NOSIGNAL);
+	decoder_cache_free();
+	swr_free(&pcm_swrcontext);
+	av_channel_layout_uninit(&pinned_layout);
+
+	if (output && output->free)
+		output->free();
 
 	if (instream)
 	{
@@ -1359,13 +5869,37 @@ quit:
 		mainloop_api->io_free(stdio_event);
 	}
 
-	if (m)
+	if (capture)
+		capture_close();
+
+	replay_close();
+
+	if (latency_event)
+		mainloop_api->time_free(latency_event);
+
+	if (metrics_event)
+		mainloop_api->io_free(metrics_event);
+
+	if (metrics_fd >= 0)
+	{
+		close(metrics_fd);
+		unlink(metrics_path);
+	}
+
+	if (mainloop)
 	{
 		pa_signal_done();
-		pa_mainloop_free(m);
+		pa_threaded_mainloop_free(mainloop);
 	}
 
-	pa_xfree(outbuffer);
+	if (trace_path)
+		trace_dump(trace_path);
+
+	packet_slots_free();
+	arena_free(&stream_arena);
+	ringbuffer_free(&stdinbuffer);
+	ringbuffer_free(&inbuffer);
+	ringbuffer_free(&outbuffer);
 
 	return ret;
 }
@@ -0,0 +1,103 @@
+/* Allocation watch for the tests, preloaded into pareceive with LD_PRELOAD.
+ * It counts the heap allocations of the whole process, and apart from them
+ * the ones the decode thread makes after lock-on outside the decoder, which
+ * fail --bench, and those it makes inside, which are reported. pareceive finds the hooks through weak references, so a
+ * normal run keeps the glibc allocator untouched */
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <errno.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+
+static unsigned long allocations = 0, steady_allocations = 0, decoder_allocations = 0;
+static int steady = 0;
+static __thread int watched = 0, in_decoder = 0;
+
+/* The calling thread is the decode thread */
+void allocwatch_thread(void)
+{
+	watched = 1;
+}
+
+/* The stream is playing, setup is over */
+void allocwatch_steady(int on)
+{
+	__atomic_store_n(&steady, on, __ATOMIC_RELAXED);
+}
+
+/* Inside avcodec, whose allocations are only counted */
+void allocwatch_decoder(int inside)
+{
+	in_decoder = inside;
+}
+
+unsigned long allocwatch_allocations(void)
+{
+	return __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+}
+
+unsigned long allocwatch_steady_allocations(void)
+{
+	return __atomic_load_n(&steady_allocations, __ATOMIC_RELAXED);
+}
+
+unsigned long allocwatch_decoder_allocations(void)
+{
+	return __atomic_load_n(&decoder_allocations, __ATOMIC_RELAXED);
+}
+
+static inline void count(void)
+{
+	__atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+	if (watched && __atomic_load_n(&steady, __ATOMIC_RELAXED))
+		__atomic_add_fetch(in_decoder ? &decoder_allocations : &steady_allocations, 1, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size)
+{
+	count();
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	count();
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	if (size)
+		count();
+	return __libc_realloc(ptr, size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+	void *p;
+
+	if (alignment % sizeof(void *) || alignment & (alignment - 1))
+		return EINVAL;
+
+	count();
+	if (!(p = __libc_memalign(alignment, size)))
+		return ENOMEM;
+
+	*memptr = p;
+	return 0;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+	count();
+	return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+	count();
+	return __libc_memalign(alignment, size);
+}